@@ -5,6 +5,8 @@
 #include "fchip_posfix.h"
 #include "fchip_hda_bus.h"
 #include "fchip_int.h"
+#include "fchip_hwdep.h"
+#include "fchip_debugfs.h"
 
 static int index[SNDRV_CARDS] = SNDRV_DEFAULT_IDX;
 static char* id[SNDRV_CARDS] = SNDRV_DEFAULT_STR;
@@ -19,10 +21,13 @@ static int position_fix[SNDRV_CARDS] = {[0 ... (SNDRV_CARDS-1)] = -1};
 static int bdl_pos_adj[SNDRV_CARDS] = {[0 ... (SNDRV_CARDS-1)] = -1};
 static int probe_mask[SNDRV_CARDS] = {[0 ... (SNDRV_CARDS-1)] = -1};
 static int single_cmd = -1;
+static bool cmd_batch;
 static int align_buffer_size = -1;
 static int enable_msi = -1;
+static bool threaded_irq;
 static int hda_snoop = -1;
 static int pm_blacklist = -1;
+static bool filter_selftest;
 
 
 
@@ -41,6 +46,15 @@ static int power_save = CONFIG_SND_HDA_POWER_SAVE_DEFAULT;
 module_param(enable_msi, bint, 0444);
 MODULE_PARM_DESC(enable_msi, "Enable Message Signaled Interrupt (MSI)");
 
+module_param(cmd_batch, bool, 0444);
+MODULE_PARM_DESC(cmd_batch, "Queue the codec probe verbs without waiting for each response");
+
+module_param(threaded_irq, bool, 0444);
+MODULE_PARM_DESC(threaded_irq, "Handle stream and codec interrupts in an IRQ thread");
+
+module_param(filter_selftest, bool, 0444);
+MODULE_PARM_DESC(filter_selftest, "Check the filter engines against each other at module load");
+
 
 static DEFINE_MUTEX(card_list_lock);
 static LIST_HEAD(card_list);
@@ -238,6 +252,7 @@ static void fchip_free_streams(struct fchip_azx* fchip_azx)
 	while (!list_empty(&bus->stream_list)) {
 		s = list_first_entry(&bus->stream_list, struct hdac_stream, list);
 		list_del(&s->list);
+		hrtimer_cancel(&hdac_stream_to_azx_dev(s)->irq_timer);
 		kfree(hdac_stream_to_azx_dev(s));
 	}
 }
@@ -287,9 +302,12 @@ static void fchip_free(struct fchip_azx* fchip_azx)
 		fchip_stop_chip(fchip_azx);
 	}
 
+	fchip_debugfs_free(fchip_azx);
+
 	if (bus->irq >= 0){
 		free_irq(bus->irq, (void*)fchip_azx);
 	}
+	fchip_quirk_keys_put(fchip_azx);
 
 	fchip_free_stream_pages(fchip_azx);
 	fchip_free_streams(fchip_azx);
@@ -472,6 +490,8 @@ int fchip_init_streams(struct fchip_azx* fchip_azx)
 		}
 
 		snd_hdac_stream_init(azx_to_hda_bus(fchip_azx), azx_dev_to_hdac_stream(azx_dev), i, dir, tag);
+		fchip_irq_pending_init(fchip_azx, azx_dev);
+		azx_dev->timing.bdl_pos_adj = -1;
 	}
 
 	return 0;
@@ -934,18 +954,18 @@ static void fchip_probe_work(struct work_struct *work)
 
 static int fchip_position_check(struct fchip_azx* fchip_azx, struct azx_dev* azx_dev)
 {
-	struct fchip_hda_intel *hda = container_of(fchip_azx, struct fchip_hda_intel, chip);
 	int ok;
 
 	ok = fchip_position_ok(fchip_azx, azx_dev);
 	if (ok == 1) {
 		azx_dev->irq_pending = 0;
+		WRITE_ONCE(azx_dev->estimator.resync, true);
 		return ok;
 	} 
 	else if (ok == 0) {
 		// bogus IRQ, process it later
 		azx_dev->irq_pending = 1;
-		schedule_work(&hda->irq_pending_work);
+		fchip_irq_pending_arm(fchip_azx, azx_dev);
 	}
 	return 0;
 }
@@ -1009,6 +1029,7 @@ static int fchip_create(
 	fchip_azx->driver_type = driver_caps & 0xff;
 	
 	fchip_check_msi(fchip_azx);
+	fchip_azx->threaded_irq = threaded_irq;
 	fchip_azx->dev_index = dev;
 
 	if(jackpoll_ms[dev]>=50 && jackpoll_ms[dev]<=60000){
@@ -1018,7 +1039,6 @@ static int fchip_create(
 
 
 	INIT_LIST_HEAD(&fchip_azx->pcm_list);
-	INIT_WORK(&fchip_hda->irq_pending_work, fchip_irq_pending_work);
 	INIT_LIST_HEAD(&fchip_hda->list);
 	
 	fchip_init_vga_switcheroo(fchip_azx);
@@ -1035,12 +1055,16 @@ static int fchip_create(
 	{
 		fchip_azx->single_cmd = single_cmd;
 	} 
+	fchip_azx->cmd_batch = cmd_batch;
 
 	fchip_check_snoop_available(fchip_azx);
 
+	mutex_init(&fchip_azx->bdl_pos_adj_lock);
 	if (bdl_pos_adj[dev] < 0)
 	{
 		fchip_azx->bdl_pos_adj = default_bdl_pos_adj(fchip_azx);
+		// only 0 turns the delayed handling off, and that stays off
+		fchip_azx->bdl_pos_adj_auto = fchip_azx->bdl_pos_adj > 0;
 	}
 	else
 	{
@@ -1066,6 +1090,7 @@ static int fchip_create(
 	}
 
 	fchip_check_probe_mask(fchip_azx, dev);
+	fchip_quirk_keys_get(fchip_azx);
 
 	err = snd_device_new(card, SNDRV_DEV_LOWLEVEL, fchip_azx, &ops);
 	if (err < 0) {
@@ -1110,6 +1135,7 @@ int fchip_probe_continue(struct fchip_azx *fchip_azx)
 	struct hdac_bus *bus = azx_to_hda_bus(fchip_azx);
 	struct pci_dev *pci = fchip_azx->pci;
 	int dev = fchip_azx->dev_index;
+	u64 start;
 	int err;
 
 	if (fchip_azx->disabled || hda->init_failed)
@@ -1129,7 +1155,9 @@ int fchip_probe_continue(struct fchip_azx *fchip_azx)
  	// needs the interaction with graphics driver. it also toggles the codec wakeup
 	fchip_display_power(fchip_azx, true);
 
+	start = ktime_get_ns();
 	err = fchip_first_init(fchip_azx);
+	fchip_azx->probe_ns[FCHIP_PROBE_CONTROLLER] = ktime_get_ns() - start;
 	if (err < 0){
 		goto out_free;
 	}
@@ -1159,7 +1187,9 @@ int fchip_probe_continue(struct fchip_azx *fchip_azx)
 
  probe_retry:
 	if (bus->codec_mask && !(probe_only[dev] & 1)) {
+		start = ktime_get_ns();
 		err = fchip_codec_configure(fchip_azx);
+		fchip_azx->probe_ns[FCHIP_PROBE_CONFIGURE] += ktime_get_ns() - start;
 		if (err) {
 			if ((fchip_azx->driver_caps & AZX_DCAPS_RETRY_PROBE) &&
 			    ++hda->probe_retry < 60) {
@@ -1172,10 +1202,19 @@ int fchip_probe_continue(struct fchip_azx *fchip_azx)
 		}
 	}
 
+	// the filters work without it, only the upload is gone
+	err = fchip_hwdep_new(fchip_azx);
+	if (err < 0){
+		printk(KERN_WARNING "fchip: Cannot create the hwdep device (%d)\n", err);
+	}
+
+	start = ktime_get_ns();
 	err = snd_card_register(fchip_azx->card);
+	fchip_azx->probe_ns[FCHIP_PROBE_REGISTER] = ktime_get_ns() - start;
 	if (err < 0){
 		goto out_free;
 	}
+	fchip_debugfs_init(fchip_azx);
 
 	fchip_setup_vga_switcheroo_runtime_pm(fchip_azx);
 
@@ -1699,14 +1738,30 @@ static struct pci_driver driver = {
 };
 
 static int __init alsa_card_filterchip_init(void){
+	int err;
+
     printk(KERN_DEBUG "fchip: init called\n");
 	fchip_pcm_validate_filter_params();
-	return pci_register_driver(&driver);
+	fchip_filter_select_kernel();
+	if (filter_selftest) {
+		err = fchip_filter_selftest();
+		if (err < 0){
+			return err;
+		}
+	}
+	fchip_debugfs_register();
+	err = pci_register_driver(&driver);
+	if (err < 0){
+		fchip_debugfs_unregister();
+	}
+	return err;
 }
 
 static void __exit alsa_card_filterchip_exit(void){
     printk(KERN_DEBUG "fchip: exit called\n");
     pci_unregister_driver(&driver);
+    fchip_debugfs_unregister();
+    fchip_filter_cache_free();
 }
 
 module_init(alsa_card_filterchip_init)
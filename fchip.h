@@ -5,6 +5,8 @@
 #include <linux/slab.h>
 #include <linux/firmware.h>
 #include <linux/workqueue.h>
+#include <linux/hrtimer.h>
+#include <linux/jump_label.h>
 #include <sound/core.h>
 #include <sound/initval.h>
 #include <sound/hda_codec.h>
@@ -202,6 +204,61 @@ enum {
 #pragma endregion
 
 
+#define FCHIP_IRQ_HIST_BINS 16
+
+// how the period interrupts of a stream line up with its DMA position,
+// recorded by fchip_position_ok to tune bdl_pos_adj per stream
+struct fchip_irq_timing {
+	u32 wallclk_hist[FCHIP_IRQ_HIST_BINS];	// since the last boundary, in 1/8 periods
+	u32 pos_hist[FCHIP_IRQ_HIST_BINS];	// pos % period_bytes, in 1/16 periods
+	u64 irqs;
+	u64 deferred;		// the position wasn't at the boundary yet
+
+	// the current tuning window
+	u32 window_irqs;
+	u32 window_deferred;
+	u32 window_short;	// frames the position was short at most
+
+	int bdl_pos_adj;	// tuned; -1 while the chip default is fine
+};
+
+// the pointer position extrapolated from the last hardware read, see
+// fchip_pcm_estimate_position. the error is what the estimate was off 
+// by when the hardware was read again, in frames (positive: ahead)
+struct fchip_pos_estimator {
+	u64 anchor_ns;
+	unsigned int anchor_pos;	// bytes
+	long anchor_delay;
+	unsigned int last;		// the last position reported
+	unsigned int reads_per_update;	// position and delay callbacks
+	bool anchored;
+	bool resync;			// set on period interrupts
+
+	u64 updates;			// hardware reads
+	u64 estimates;			// reads saved by an estimate
+	u64 reads_saved;
+	u64 held;			// the hardware was behind the estimate
+	u64 err_samples;
+	u64 err_abs_sum;
+	int err_min;
+	int err_max;
+};
+
+// WALLCLK runs at 24 MHz
+#define FCHIP_WALLCLK_TO_NS(ticks)	div_u64((u64)(ticks) * 125, 3)
+
+// the controller clock (WALLCLK, the 24 MHz the sample clocks are made
+// from) against CLOCK_MONOTONIC_RAW, measured at the period interrupts
+// of the stream, see fchip_drift_record. read through the Clock Drift 
+// controls (fchip_pcm_add_drift_control), under reg_lock
+struct fchip_drift {
+	u64 anchor_ns;
+	u32 anchor_wallclk;
+	s64 ppb;		// filtered; positive: the controller runs fast
+	s64 dev_ppb;		// mean deviation of the windows from ppb
+	u64 windows;
+};
+
 struct azx_dev {
 	struct hdac_stream core;
 
@@ -212,13 +269,57 @@ struct azx_dev {
 	 *  when link position is not greater than FIFO size
 	 */
 	unsigned int insufficient:1;
+
+	struct fchip_irq_timing timing;
+	struct fchip_pos_estimator estimator;
+	struct fchip_drift drift;
+
+	// late position check instead of the period interrupt, see
+	// fchip_irq_pending_arm
+	struct hrtimer irq_timer;
+	struct fchip_azx *chip;
+};
+
+// interrupt handler statistics, shown in debugfs (irq_stats)
+struct fchip_irq_stats {
+	u64 irqs;		// interrupts that had a status set
+	u64 loops;		// INTSTS reads
+	u64 repeats;		// INTSTS reads after the first
+	u64 limit_hits;		// interrupts that ran into the loop limit
+	atomic64_t elapsed;	// snd_pcm_period_elapsed calls, counted outside reg_lock
+	u32 max_loops;
+};
+
+// the phases of fchip_probe_continue, timed in debugfs (probe_timing)
+enum fchip_probe_phase {
+	FCHIP_PROBE_CONTROLLER,	// fchip_first_init
+	FCHIP_PROBE_SLOTS,	// the vendor ID of each codec slot
+	FCHIP_PROBE_CODECS,	// snd_hda_codec_new
+	FCHIP_PROBE_CONFIGURE,	// fchip_codec_configure, retries included
+	FCHIP_PROBE_REGISTER,	// snd_card_register
+	FCHIP_PROBE_PHASES,
 };
 
 // very necessary line of code, for callbacks to be casted properly
 struct fchip_azx;
+struct fchip_hwdep;
+
+// how the DMA position and the delay are read, per direction. these
+// select direct calls in fchip_get_position/fchip_get_delay instead of
+// going through function pointers (an indirect call with retpolines)
+enum fchip_pos_method {
+	FCHIP_POS_DEFAULT,	// posbuf, until fchip_position_ok checks it
+	FCHIP_POS_LPIB,
+	FCHIP_POS_POSBUF,
+	FCHIP_POS_VIA,
+	FCHIP_POS_FIFO,
+};
 
-typedef unsigned int (*azx_get_pos_callback_t)(struct fchip_azx *, struct azx_dev *);
-typedef int (*azx_get_delay_callback_t)(struct fchip_azx *, struct azx_dev *, unsigned int pos);
+enum fchip_delay_method {
+	FCHIP_DELAY_NONE,
+	FCHIP_DELAY_LPIB,
+	FCHIP_DELAY_FIFO,
+};
 
 struct fchip_azx {
 	struct hda_bus bus;
@@ -240,9 +341,10 @@ struct fchip_azx {
 	// Register interaction
 	const struct hda_controller_ops *ops;
 
-	// position adjustment callbacks
-	azx_get_pos_callback_t get_position[2];
-	azx_get_delay_callback_t get_delay[2];
+	// position adjustment, see assign_position_fix. fchip_position_ok
+	// can change them while streams run: READ_ONCE/WRITE_ONCE
+	u8 pos_method[2];
+	u8 delay_method[2];
 
 	// locks
 	struct mutex open_mutex; // Prevents concurrent open/close operations
@@ -255,22 +357,45 @@ struct fchip_azx {
 	unsigned int beep_mode;
 	bool ctl_dev_id;
 
+	// coefficient upload, see fchip_hwdep.h; NULL if it failed
+	struct fchip_hwdep *hwdep;
+
 #ifdef CONFIG_SND_HDA_PATCH_LOADER
 	const struct firmware *fw;
 #endif
 
+	// streams whose period elapsed, collected under reg_lock
+	unsigned long irq_elapsed;
+	struct fchip_irq_stats irq_stats;
+	struct dentry *debugfs;		// <debugfs>/fchip/cardN
+	u64 probe_ns[FCHIP_PROBE_PHASES];
+
+	// batched verbs, see fchip_bus_queue_verbs. under reg_lock
+	unsigned int corb_wp;		// the last CORB entry written, maybe not rung
+	unsigned int corb_rp;		// CORBRP as last read
+	unsigned int corb_pending;	// entries written since the last ring
+
+	// threaded IRQ: what the hard half latched for the thread
+	unsigned long irq_streams;	// bit per stream index
+	unsigned long irq_rirb;		// bit 0: a codec response arrived
+
 	// flags
 	int bdl_pos_adj;
+	bool bdl_pos_adj_auto;		// tuned per stream, see fchip_bdl_pos_adj_tune
+	struct mutex bdl_pos_adj_lock;	// bus->core.bdl_pos_adj, see fchip_pcm_setup_bdl
 	unsigned int running:1;
 	unsigned int fallback_to_single_cmd:1;
 	unsigned int single_cmd:1;
+	unsigned int cmd_batch:1; // see fchip_bus_queue_verbs
 	unsigned int msi:1;
+	unsigned int threaded_irq:1; // see fchip_acquire_irq
 	unsigned int probing:1; // codec probing phase
 	unsigned int snoop:1;
 	unsigned int uc_buffer:1; // non-cached pages for stream buffers
 	unsigned int align_buffer_size:1;
 	unsigned int disabled:1; // disabled by vga_switcheroo
 	unsigned int pm_prepared:1;
+	unsigned int quirk_keys; // FCHIP_QUIRK_* taken, see fchip_quirk_keys_get
 
 	// GTS present
 	unsigned int gts_present:1;
@@ -284,9 +409,6 @@ struct fchip_azx {
 struct fchip_hda_intel {
 	struct fchip_azx chip;
 
-	// for pending irqs
-	struct work_struct irq_pending_work;
-
 	// sync probing
 	struct completion probe_wait;
 	struct delayed_work probe_work;
@@ -372,6 +494,33 @@ struct hda_controller_ops {
 #define fchip_has_pm_runtime(fchip_azx) \
 	((fchip_azx)->driver_caps & AZX_DCAPS_PM_RUNTIME)
 
+// rare quirks tested on every interrupt and position check. 
+// driver_caps and driver_type are final once fchip_create is done, so 
+// each card holds a reference on the static key of every quirk it has:
+// with no such card the tests are patched out, and the rest of the test
+// only runs when some card in the system has the quirk. common caps 
+// (AZX_DCAPS_PM_RUNTIME is on nearly every Intel PCH) would keep their
+// key on and are tested directly
+enum {
+	FCHIP_QUIRK_CTX_WORKAROUND = BIT(0),
+	FCHIP_QUIRK_LOONGSON = BIT(1),
+};
+
+DECLARE_STATIC_KEY_FALSE(fchip_ctx_workaround_key);
+DECLARE_STATIC_KEY_FALSE(fchip_loongson_key);
+
+static inline bool fchip_quirk_ctx_workaround(struct fchip_azx *fchip_azx)
+{
+	return static_branch_unlikely(&fchip_ctx_workaround_key) &&
+		(fchip_azx->driver_caps & AZX_DCAPS_CTX_WORKAROUND);
+}
+
+static inline bool fchip_quirk_loongson(struct fchip_azx *fchip_azx)
+{
+	return static_branch_unlikely(&fchip_loongson_key) &&
+		fchip_azx->driver_type == AZX_DRIVER_LOONGSON;
+}
+
 
 void fchip_init_chip(struct fchip_azx* fchip_azx, bool full_reset);
 void fchip_stop_chip(struct fchip_azx* fchip_azx);
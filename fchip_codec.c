@@ -14,65 +14,122 @@ static inline struct azx_dev *get_azx_dev(struct snd_pcm_substream *substream)
 	return substream->runtime->private_data;
 }
 
-static int probe_codec(struct fchip_azx* fchip_azx, int addr)
+#define fchip_vendor_id_cmd(addr) \
+	(((addr) << 28) | (AC_NODE_ROOT << 20) | (AC_VERB_PARAMETERS << 8) | AC_PAR_VENDOR_ID)
+
+// the core waits one second for a response; the same, for all the slots
+#define FCHIP_PROBE_TIMEOUT_MS	1000
+
+// the vendor ID verbs of all the slots go out before the first response
+// is waited for (in one CORB write with cmd_batch), and all of them 
+// share one deadline: the codecs answer, and missing ones time out, at
+// the same time instead of one after the other. the RIRB is read here 
+// as well, so this doesn't depend on the interrupt working yet. 
+// returns the slots that answered
+static unsigned int probe_codecs_batched(struct fchip_azx* fchip_azx, unsigned int slots)
 {
-	unsigned int cmd = (addr << 28) | (AC_NODE_ROOT << 20) |
-		(AC_VERB_PARAMETERS << 8) | AC_PAR_VENDOR_ID;
 	struct hdac_bus *bus = azx_to_hda_bus(fchip_azx);
-	int err;
-	unsigned int res = -1;
+	unsigned int verbs[FCHIP_AZX_MAX_CODECS];
+	unsigned int ok = 0, waiting;
+	unsigned long deadline;
+	int c, addr, count, sent;
+
+	count = 0;
+	for (c = 0; c < FCHIP_AZX_MAX_CODECS; c++) {
+		if (slots & BIT(c)){
+			verbs[count++] = fchip_vendor_id_cmd(c);
+		}
+	}
 
 	mutex_lock(&bus->cmd_mutex);
 	fchip_azx->probing = 1;
-	fchip_send_cmd(bus, cmd);
-	err = fchip_get_response(bus, addr, &res);
+	for (c = 0; c < FCHIP_AZX_MAX_CODECS; c++){
+		bus->rirb.res[c] = -1;
+	}
+	// a verb that can't be sent (an immediate command timing out) 
+	// leaves the response at -1; the others still go
+	for (c = 0; c < count; c += sent + 1){
+		sent = fchip_bus_queue_verbs(fchip_azx, verbs + c, count - c);
+	}
+	deadline = jiffies + msecs_to_jiffies(FCHIP_PROBE_TIMEOUT_MS);
+	for (;;) {
+		waiting = 0;
+		spin_lock_irq(&bus->reg_lock);
+		if (!fchip_azx->single_cmd && !bus->use_pio_for_commands){
+			snd_hdac_bus_update_rirb(bus);
+		}
+		for (c = 0; c < count; c++) {
+			addr = verbs[c] >> 28;
+			if (bus->rirb.cmds[addr]){
+				waiting |= BIT(addr);
+			}
+		}
+		// a silent slot: nothing is waited for from it any more, a 
+		// late answer is dropped as spurious by snd_hdac_bus_update_rirb
+		if (waiting && time_after(jiffies, deadline)) {
+			for (c = 0; c < FCHIP_AZX_MAX_CODECS; c++){
+				if (waiting & BIT(c)){
+					bus->rirb.cmds[c] = 0;
+				}
+			}
+		}
+		spin_unlock_irq(&bus->reg_lock);
+		if (!waiting || time_after(jiffies, deadline)){
+			break;
+		}
+		usleep_range(100, 200);
+	}
+	for (c = 0; c < count; c++) {
+		addr = verbs[c] >> 28;
+		if (!(waiting & BIT(addr)) && bus->rirb.res[addr] != -1) {
+			printk(KERN_DEBUG "fchip: Codec #%d probed OK\n", addr);
+			ok |= BIT(addr);
+		}
+	}
 	fchip_azx->probing = 0;
 	mutex_unlock(&bus->cmd_mutex);
-	
-	if (err < 0 || res == -1){
-		return -EIO;
-	}
-
-	printk(KERN_DEBUG "fchip: Codec #%d probed OK\n", addr);
-	return 0;
+	return ok;
 }
 
 int fchip_probe_codecs(struct fchip_azx* fchip_azx, unsigned int max_slots)
 {
 	struct hdac_bus *bus = azx_to_hda_bus(fchip_azx);
+	unsigned int slots, probed;
 	int c, codecs, err;
+	u64 start;
 
 	codecs = 0;
 	if (!max_slots){
 		max_slots = AZX_DEFAULT_CODECS;
 	}
 
-	// First try to probe all given codec slots
-	for (c = 0; c < max_slots; c++) {
-		if ((bus->codec_mask & (1 << c)) & fchip_azx->codec_probe_mask) {
-			if (probe_codec(fchip_azx, c) < 0) {
-				
-				// Some BIOSen give you wrong codec addresses
-				// that don't exist
+	// First try to probe all given codec slots, all at once
+	start = ktime_get_ns();
+	slots = bus->codec_mask & fchip_azx->codec_probe_mask & (BIT(max_slots) - 1);
+	probed = probe_codecs_batched(fchip_azx, slots);
+	if (probed != slots) {
+		// Some BIOSen give you wrong codec addresses that don't exist.
+		// the slots that answered keep their answer, the silent ones
+		// are not asked again
+		for (c = 0; c < max_slots; c++) {
+			if (slots & ~probed & BIT(c)) {
 				printk(KERN_WARNING "fchip: Codec #%d probe error; disabling it...\n", c);
 				bus->codec_mask &= ~(1 << c);
-				// no codecs
-				if (bus->codec_mask == 0){
-					break;
-				}
-				// More badly, accessing to a non-existing
-				// codec often screws up the controller chip,
-				// and disturbs the further communications.
-				// Thus if an error occurs during probing,
-				// better to reset the controller chip to
-				// get back to the sanity state.
-				fchip_stop_chip(fchip_azx);
-				fchip_init_chip(fchip_azx, true);
 			}
 		}
+		// More badly, accessing to a non-existing codec often screws 
+		// up the controller chip, and disturbs the further 
+		// communications. one reset for all of them
+		if (bus->codec_mask){
+			fchip_stop_chip(fchip_azx);
+			fchip_init_chip(fchip_azx, true);
+		}
 	}
+	fchip_azx->probe_ns[FCHIP_PROBE_SLOTS] = ktime_get_ns() - start;
 
-	// Then create codec instances
+	// Then create codec instances. one at a time: snd_hda_codec_new 
+	// adds to the bus and card lists without locking
+	start = ktime_get_ns();
 	for (c = 0; c < max_slots; c++) {
 		if ((bus->codec_mask & (1 << c)) & fchip_azx->codec_probe_mask) {
 			struct hda_codec *codec;
@@ -87,6 +144,7 @@ int fchip_probe_codecs(struct fchip_azx* fchip_azx, unsigned int max_slots)
 			codecs++;
 		}
 	}
+	fchip_azx->probe_ns[FCHIP_PROBE_CODECS] = ktime_get_ns() - start;
 	if (!codecs) {
 		printk(KERN_ERR "fchip: No codecs initialized\n");
 		return -ENXIO;
@@ -108,6 +166,9 @@ static void fchip_codec_rewrite_ops(struct snd_pcm_ops *new_ops, struct snd_pcm_
 	
 	new_ops->open = fchip_pcm_open;
 	new_ops->pointer = fchip_pcm_pointer;
+	new_ops->ack = fchip_pcm_ack;
+	new_ops->copy = fchip_pcm_copy;
+	new_ops->mmap = fchip_pcm_mmap;
 	new_ops->close = fchip_pcm_close;
 	new_ops->hw_params = fchip_pcm_hw_params;
 	new_ops->hw_free = fchip_pcm_hw_free;
@@ -135,6 +196,15 @@ int fchip_codec_configure(struct fchip_azx* fchip_azx)
 			list_for_each_entry(codec_pcm, &codec->pcm_list_head, list) {
 				for (int dir = 0; dir < 2; dir++) {
 					if (codec_pcm->stream[dir].substreams){
+						if (fchip_pcm_add_filter_controls(codec_pcm->pcm, dir) < 0){
+							printk(KERN_WARNING "fchip: unable to add the filter controls of pcm %d\n", 
+								codec_pcm->pcm->device);
+						}
+						if (fchip_pcm_add_drift_control(codec_pcm->pcm, dir) < 0){
+							printk(KERN_WARNING "fchip: unable to add the clock drift control of pcm %d\n", 
+								codec_pcm->pcm->device);
+						}
+
 						// snd_pcm_set_ops(codec_pcm->pcm, s, &azx_pcm_ops);
 						
 						// a dirty-dirty approach. the goal is to override one operation,
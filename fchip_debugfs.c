@@ -0,0 +1,132 @@
+#include <linux/debugfs.h>
+#include <linux/seq_file.h>
+#include "fchip_debugfs.h"
+#include "fchip_posfix.h"
+
+static struct dentry *fchip_debugfs_root;
+
+static int fchip_irq_stats_show(struct seq_file *m, void *v)
+{
+	struct fchip_azx *chip = m->private;
+	struct fchip_irq_stats *stats = &chip->irq_stats;
+
+	seq_printf(m, "irqs: %llu\n", stats->irqs);
+	seq_printf(m, "loops: %llu\n", stats->loops);
+	seq_printf(m, "repeats: %llu\n", stats->repeats);
+	seq_printf(m, "max_loops: %u\n", stats->max_loops);
+	seq_printf(m, "limit_hits: %llu\n", stats->limit_hits);
+	seq_printf(m, "period_elapsed: %lld\n", (s64)atomic64_read(&stats->elapsed));
+	return 0;
+}
+DEFINE_SHOW_ATTRIBUTE(fchip_irq_stats);
+
+static void fchip_hist_show(struct seq_file *m, const char *name, const u32 *hist)
+{
+	seq_printf(m, "  %s:", name);
+	for (int i = 0; i < FCHIP_IRQ_HIST_BINS; i++){
+		seq_printf(m, " %u", hist[i]);
+	}
+	seq_putc(m, '\n');
+}
+
+// how long the card took to come up, see enum fchip_probe_phase
+static int fchip_probe_timing_show(struct seq_file *m, void *v)
+{
+	static const char * const names[FCHIP_PROBE_PHASES] = {
+		[FCHIP_PROBE_CONTROLLER] = "controller",
+		[FCHIP_PROBE_SLOTS] = "slots",
+		[FCHIP_PROBE_CODECS] = "codecs",
+		[FCHIP_PROBE_CONFIGURE] = "configure",
+		[FCHIP_PROBE_REGISTER] = "register",
+	};
+	struct fchip_azx *chip = m->private;
+
+	for (int i = 0; i < FCHIP_PROBE_PHASES; i++){
+		seq_printf(m, "%s: %llu us\n", names[i], div_u64(chip->probe_ns[i], NSEC_PER_USEC));
+	}
+	return 0;
+}
+DEFINE_SHOW_ATTRIBUTE(fchip_probe_timing);
+
+// the streams that had period interrupts, see fchip_position_ok
+static int fchip_irq_timing_show(struct seq_file *m, void *v)
+{
+	struct fchip_azx *chip = m->private;
+	struct hdac_bus *bus = azx_to_hda_bus(chip);
+	struct hdac_stream *s;
+	struct fchip_irq_timing *timing;
+
+	seq_printf(m, "bdl_pos_adj: %d (%s)\n", chip->bdl_pos_adj, 
+		chip->bdl_pos_adj_auto ? "tuned per stream" : "fixed");
+	list_for_each_entry(s, &bus->stream_list, list) {
+		timing = &hdac_stream_to_azx_dev(s)->timing;
+		if (!timing->irqs){
+			continue;
+		}
+		seq_printf(m, "stream %d: bdl_pos_adj %d, irqs %llu, deferred %llu\n", s->index,
+			fchip_stream_bdl_pos_adj(chip, hdac_stream_to_azx_dev(s)), timing->irqs, timing->deferred);
+		// 1/8 periods since the last boundary, the last bin is 15/8 and up
+		fchip_hist_show(m, "wallclk", timing->wallclk_hist);
+		// 1/16 periods past the boundary; the upper half is an early interrupt
+		fchip_hist_show(m, "pos", timing->pos_hist);
+	}
+	return 0;
+}
+DEFINE_SHOW_ATTRIBUTE(fchip_irq_timing);
+
+// the streams that had their pointer position estimated, see 
+// fchip_pcm_estimate_position. errors are in frames, positive when
+// the estimate was ahead of the hardware
+static int fchip_position_estimator_show(struct seq_file *m, void *v)
+{
+	struct fchip_azx *chip = m->private;
+	struct hdac_bus *bus = azx_to_hda_bus(chip);
+	struct hdac_stream *s;
+	struct fchip_pos_estimator *est;
+
+	list_for_each_entry(s, &bus->stream_list, list) {
+		est = &hdac_stream_to_azx_dev(s)->estimator;
+		if (!est->estimates){
+			continue;
+		}
+		seq_printf(m, "stream %d: reads %llu, estimates %llu, reads saved %llu, held %llu\n", 
+			s->index, est->updates, est->estimates, est->reads_saved, est->held);
+		if (est->err_samples){
+			seq_printf(m, "  error: min %d, max %d, mean abs %llu.%02llu\n", est->err_min, est->err_max,
+				div64_u64(est->err_abs_sum, est->err_samples),
+				div64_u64(est->err_abs_sum * 100, est->err_samples) % 100);
+		}
+	}
+	return 0;
+}
+DEFINE_SHOW_ATTRIBUTE(fchip_position_estimator);
+
+// debugfs errors are not fatal (nor checked): the driver works without
+void fchip_debugfs_register(void)
+{
+	fchip_debugfs_root = debugfs_create_dir("fchip", NULL);
+}
+
+void fchip_debugfs_unregister(void)
+{
+	debugfs_remove_recursive(fchip_debugfs_root);
+	fchip_debugfs_root = NULL;
+}
+
+void fchip_debugfs_init(struct fchip_azx *chip)
+{
+	char name[16];
+
+	snprintf(name, sizeof(name), "card%d", chip->card->number);
+	chip->debugfs = debugfs_create_dir(name, fchip_debugfs_root);
+	debugfs_create_file("irq_stats", 0444, chip->debugfs, chip, &fchip_irq_stats_fops);
+	debugfs_create_file("irq_timing", 0444, chip->debugfs, chip, &fchip_irq_timing_fops);
+	debugfs_create_file("position_estimator", 0444, chip->debugfs, chip, &fchip_position_estimator_fops);
+	debugfs_create_file("probe_timing", 0444, chip->debugfs, chip, &fchip_probe_timing_fops);
+}
+
+void fchip_debugfs_free(struct fchip_azx *chip)
+{
+	debugfs_remove_recursive(chip->debugfs);
+	chip->debugfs = NULL;
+}
\ No newline at end of file
@@ -0,0 +1,10 @@
+#pragma once
+#include "fchip.h"
+// this module is responsible for the statistics the driver 
+// exposes in debugfs, one directory per card: <debugfs>/fchip/cardN
+
+void fchip_debugfs_register(void);
+void fchip_debugfs_unregister(void);
+
+void fchip_debugfs_init(struct fchip_azx *chip);
+void fchip_debugfs_free(struct fchip_azx *chip);
\ No newline at end of file
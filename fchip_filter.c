@@ -1,163 +1,777 @@
 #include <linux/slab.h>
+#include <linux/mutex.h>
+#ifdef CONFIG_X86
+#include <asm/cpufeature.h>
+#endif
 #include "fchip_pcm.h"
 #include "fchip_filter.h"
+#include "fchip_filter_kernel.h"
 
-#define M_PI 3.14159265358979323846f
-#define M_SQRT2 1.414213562373095f
+static int fchip_filter_clamp_sections(int sections)
+{
+    return clamp(sections, 1, FCHIP_FILTER_MAX_SECTIONS);
+}
 
-static fchip_float_t fchip_filter_transform_frequency(fchip_float_t sample_rate, fchip_float_t freq){
-    // the original filter had a tan function here.
-    // an approximation is used here: tan(x) ~ x + (x^3)/3 
-    fchip_float_t f = freq * M_PI / sample_rate;
-    return f + (f * f * f) / 3;
+static int fchip_filter_clamp_q(int q)
+{
+    return clamp(q, FCHIP_FILTER_Q_DEFAULT, FCHIP_FILTER_Q_MAX);
 }
 
-static void fchip_calculate_convolution_table(
-    struct fchip_channel_filter *filter
-)
+// the coefficient cache. prepare runs for every open, every xrun and 
+// every resume, and all the channels of all the streams usually share 
+// one parameter set: compute it once and hand out the same table.
+// the entries are preallocated, so a parameter change from a mixer 
+// control normally allocates nothing; the cache only grows with 
+// kzalloc'd entries when every one of them is in use
+#define FCHIP_COEFF_CACHE_SIZE 32
+
+static struct fchip_filter_coeffs fchip_coeff_pool[FCHIP_COEFF_CACHE_SIZE];
+static LIST_HEAD(fchip_coeff_cache);    // most recently used first
+static DEFINE_MUTEX(fchip_coeff_cache_lock);
+static int fchip_coeff_cache_len;
+
+// used when the coefficients can't be allocated; not in the cache
+static struct fchip_filter_coeffs fchip_coeffs_passthrough = {
+    .table = { [0 ... FCHIP_FILTER_MAX_SECTIONS - 1] = { .b0 = 1 } },
+    .table_q31 = { [0 ... FCHIP_FILTER_MAX_SECTIONS - 1] = { .b0 = 1 << (31 - FCHIP_Q31_POSTSHIFT) } },
+    .active_sections = 1,
+    .params = {
+        .filter_type = FCHIP_FILTER_NONE,
+        .sections = 1,
+    },
+};
+
+static bool fchip_coeffs_pooled(struct fchip_filter_coeffs *coeffs)
 {
-    fchip_float_t w;
-    fchip_float_t d, w1, w2, w0sqr, wd; // for bandpass filter
-    fchip_float_t a0, a1, a2, b0, b1, b2;
-    switch(filter->filter_type){
-        case FCHIP_FILTER_LOWPASS:
-            w = fchip_filter_transform_frequency(filter->sample_rate, filter->cutoff_freq);
-            
-            a0 = 1 + M_SQRT2*w + w*w;
-            a1 = -2 + 2*w*w;
-            a2 = 1 - M_SQRT2*w + w*w;
-
-            b0 = w*w;
-            b1 = 2*w*w;
-            b2 = w*w;
-    
-            break;
+    return coeffs >= fchip_coeff_pool && coeffs < fchip_coeff_pool + FCHIP_COEFF_CACHE_SIZE;
+}
 
-        case FCHIP_FILTER_HIPASS:
-            w = fchip_filter_transform_frequency(filter->sample_rate, filter->cutoff_freq);
-            
-            a0 = 1 + M_SQRT2*w + w*w;
-            a1 = -2 + 2*w*w;
-            a2 = 1 - M_SQRT2*w + w*w;
-            
-            b0 = 1;
-            b1 = -2;
-            b2 = 1;
-            break;
+static bool fchip_params_match(struct fchip_filter_params *a, struct fchip_filter_params *b)
+{
+    return a->filter_type == b->filter_type &&
+        a->sample_rate == b->sample_rate &&
+        a->cutoff_freq == b->cutoff_freq &&
+        a->sections == b->sections &&
+        a->q == b->q;
+}
 
-        case FCHIP_FILTER_BANDPASS:
-            w = filter->cutoff_freq;
-            
-            d = w/4;    // band width
-            w1 = (w-d) > 0 ? (w-d) : 0;
-            w1 = fchip_filter_transform_frequency(filter->sample_rate, w1);
-            w2 = (w+d) < filter->sample_rate ? (w+d) : filter->sample_rate;
-            w2 = fchip_filter_transform_frequency(filter->sample_rate, w2);
-
-            w0sqr = w1*w2;
-            wd = w2-w1;
-
-            a0 = -1 - wd - w0sqr;
-            a1 = 2 - 2*w0sqr;
-            a2 = -1 + wd - w0sqr;
-            
-            b0 = -wd;
-            b1 = 0;
-            b2 = wd;
-            break;
-        case FCHIP_FILTER_MUTE:
-            b0 = 0;
-            b1 = 0;
-            b2 = 0;
-            
-            a0 = 1;
-            a1 = 0;
-            a2 = 0;
+static struct fchip_filter_coeffs *fchip_coeff_cache_lookup(struct fchip_filter_params *params)
+{
+    struct fchip_filter_coeffs *coeffs;
+
+    lockdep_assert_held(&fchip_coeff_cache_lock);
+    list_for_each_entry(coeffs, &fchip_coeff_cache, node){
+        if(fchip_params_match(&coeffs->params, params)){
+            list_move(&coeffs->node, &fchip_coeff_cache);
+            atomic_inc(&coeffs->users);
+            return coeffs;
+        }
+    }
+    return NULL;
+}
+
+// an entry to compute a new set in: a pool entry never used, or the 
+// least recently used one nobody holds. NULL if everything is in use
+static struct fchip_filter_coeffs *fchip_coeff_cache_reserve(void)
+{
+    struct fchip_filter_coeffs *coeffs;
+    int i;
+
+    lockdep_assert_held(&fchip_coeff_cache_lock);
+    for(i = 0; i < FCHIP_COEFF_CACHE_SIZE; i++){
+        coeffs = &fchip_coeff_pool[i];
+        if(!coeffs->cached && !atomic_read(&coeffs->users)){
+            goto reserve;
+        }
+    }
+    list_for_each_entry_reverse(coeffs, &fchip_coeff_cache, node){
+        if(!atomic_read(&coeffs->users)){
+            list_del(&coeffs->node);
+            fchip_coeff_cache_len--;
+            coeffs->cached = false;
+            goto reserve;
+        }
+    }
+    return NULL;
+
+reserve:
+    atomic_set(&coeffs->users, 1);
+    return coeffs;
+}
+
+// gives back a reserved entry that wasn't needed after all
+static void fchip_coeff_cache_unreserve(struct fchip_filter_coeffs *coeffs)
+{
+    lockdep_assert_held(&fchip_coeff_cache_lock);
+    if(fchip_coeffs_pooled(coeffs)){
+        atomic_set(&coeffs->users, 0);
+        return;
+    }
+    kfree(coeffs);
+}
+
+// frees the least recently used kzalloc'd entries nobody holds, 
+// once the pool could take their place
+static void fchip_coeff_cache_trim(void)
+{
+    struct fchip_filter_coeffs *coeffs, *tmp;
+
+    lockdep_assert_held(&fchip_coeff_cache_lock);
+    list_for_each_entry_safe_reverse(coeffs, tmp, &fchip_coeff_cache, node){
+        if(fchip_coeff_cache_len <= FCHIP_COEFF_CACHE_SIZE){
             break;
+        }
+        if(fchip_coeffs_pooled(coeffs) || atomic_read(&coeffs->users)){
+            continue;
+        }
+        list_del(&coeffs->node);
+        fchip_coeff_cache_len--;
+        kfree(coeffs);
+    }
+}
+
+static struct fchip_filter_coeffs *fchip_coeff_cache_get(struct fchip_filter_params *params)
+{
+    struct fchip_filter_coeffs *coeffs, *cached;
 
-        // case FCHIP_FILTER_NONE:
-        default:
-            b0 = 1;
-            b1 = 0;
-            b2 = 0;
-            
-            a0 = 1;
-            a1 = 0;
-            a2 = 0;
+    mutex_lock(&fchip_coeff_cache_lock);
+    coeffs = fchip_coeff_cache_lookup(params);
+    if(!coeffs){
+        coeffs = fchip_coeff_cache_reserve();
+        cached = NULL;
+    }
+    else{
+        cached = coeffs;
+    }
+    mutex_unlock(&fchip_coeff_cache_lock);
+    if(cached){
+        return cached;
+    }
 
+    if(!coeffs){
+        coeffs = kzalloc(sizeof(*coeffs), GFP_KERNEL);
+        if(!coeffs){
+            return NULL;
+        }
+        atomic_set(&coeffs->users, 1);
+    }
+
+    // computed outside the lock: the FPU section disables preemption
+    coeffs->params = *params;
+    fchip_fpu_begin();
+    fchip_calculate_convolution_table(coeffs);
+    fchip_fpu_end();
+
+    mutex_lock(&fchip_coeff_cache_lock);
+    // another stream may have been preparing the same parameters
+    cached = fchip_coeff_cache_lookup(params);
+    if(cached){
+        fchip_coeff_cache_unreserve(coeffs);
+        coeffs = cached;
+    }
+    else{
+        coeffs->cached = true;
+        list_add(&coeffs->node, &fchip_coeff_cache);
+        fchip_coeff_cache_len++;
+        fchip_coeff_cache_trim();
+    }
+    mutex_unlock(&fchip_coeff_cache_lock);
+    return coeffs;
+}
+
+static void fchip_coeff_cache_hold(struct fchip_filter_coeffs *coeffs, int refs)
+{
+    if(coeffs->cached){
+        atomic_add(refs, &coeffs->users);
+    }
+}
+
+// lockless, so the data path can drop references too. an entry
+// nobody holds is only reused or freed under the cache lock
+static void fchip_coeff_cache_put(struct fchip_filter_coeffs *coeffs)
+{
+    if(!coeffs || !coeffs->cached){
+        return;
     }
-    filter->coeffs.b0 = b0 / a0;
-    filter->coeffs.b1 = b1 / a0;
-    filter->coeffs.b2 = b2 / a0;
+    atomic_dec(&coeffs->users);
+}
+
+void fchip_filter_cache_free(void)
+{
+    struct fchip_filter_coeffs *coeffs, *tmp;
 
-    filter->coeffs.a1 = a1 / a0;
-    filter->coeffs.a2 = a2 / a0;
+    mutex_lock(&fchip_coeff_cache_lock);
+    list_for_each_entry_safe(coeffs, tmp, &fchip_coeff_cache, node){
+        WARN_ON(atomic_read(&coeffs->users));
+        list_del(&coeffs->node);
+        coeffs->cached = false;
+        if(!fchip_coeffs_pooled(coeffs)){
+            kfree(coeffs);
+        }
+    }
+    fchip_coeff_cache_len = 0;
+    mutex_unlock(&fchip_coeff_cache_lock);
 }
 
-struct fchip_channel_filter* fchip_filter_create(enum fchip_filter_type filter_type, int sample_rate, fchip_float_t cutoff_freq)
+struct fchip_channel_filter* fchip_filter_create(enum fchip_filter_type filter_type, int sample_rate, int cutoff_freq, int sections)
 {
     struct fchip_channel_filter *filter = kzalloc(sizeof(struct fchip_channel_filter), GFP_KERNEL);
-    filter->filter_type = filter_type;
-    filter->cutoff_freq = cutoff_freq;
-    filter->sample_rate = sample_rate;
-    fchip_calculate_convolution_table(filter);
+    if(!filter){
+        return NULL;
+    }
+    fchip_filter_change_params(filter, filter_type, sample_rate, cutoff_freq, sections, FCHIP_FILTER_Q_DEFAULT);
     return filter;
 }
 
-void fchip_filter_change_params(
-    struct fchip_channel_filter *filter, 
+void fchip_filter_destroy(struct fchip_channel_filter *filter)
+{
+    fchip_filter_release(filter);
+    kfree(filter);
+}
+
+void fchip_filter_release(struct fchip_channel_filter *filter)
+{
+    fchip_coeff_cache_put(filter->coeffs);
+    filter->coeffs = NULL;
+}
+
+// NOCHANGE values are taken from `current`
+static void fchip_filter_resolve_params(
+    struct fchip_filter_params *params,
+    struct fchip_filter_params *current_params,
     enum fchip_filter_type filter_type, 
-    fchip_float_t sample_rate,
-    fchip_float_t cutoff_freq
-    )
+    int sample_rate,
+    int cutoff_freq,
+    int sections,
+    int q
+)
 {
+    *params = *current_params;
     if (filter_type != FCHIP_FPARAM_FILTERTYPE_NOCHANGE){
-        filter->filter_type = filter_type;
+        params->filter_type = filter_type;
     }
     if(sample_rate != FCHIP_FPARAM_SAMPLERATE_NOCHANGE){
-        filter->sample_rate = sample_rate;
+        params->sample_rate = sample_rate;
     }
     if(cutoff_freq != FCHIP_FPARAM_CUTOFF_NOCHANGE){
-        filter->cutoff_freq = cutoff_freq;
+        params->cutoff_freq = cutoff_freq;
+    }
+    if(sections != FCHIP_FPARAM_SECTIONS_NOCHANGE){
+        params->sections = sections;
+    }
+    if(q != FCHIP_FPARAM_Q_NOCHANGE){
+        params->q = q;
+    }
+    params->sections = fchip_filter_clamp_sections(params->sections);
+    params->q = fchip_filter_clamp_q(params->q);
+}
+
+int fchip_filter_change_params(
+    struct fchip_channel_filter *filter, 
+    enum fchip_filter_type filter_type, 
+    int sample_rate,
+    int cutoff_freq,
+    int sections,
+    int q
+    )
+{
+    struct fchip_filter_params params;
+    struct fchip_filter_coeffs *coeffs;
+
+    fchip_filter_resolve_params(&params, &filter->params, filter_type, sample_rate, 
+        cutoff_freq, sections, q);
+
+    fchip_filter_clear_buffers(filter);
+
+    // a re-prepare with the same parameters costs nothing
+    if(filter->coeffs && filter->coeffs->cached &&
+        fchip_params_match(&filter->coeffs->params, &params)){
+        return 0;
     }
 
-    
-    for(int i = 0; i < 3; i++){
-        filter->raw[i] = 0;
-        filter->processed[i] = 0;
+    coeffs = fchip_coeff_cache_get(&params);
+    if(!coeffs){
+        if(!filter->coeffs){
+            filter->coeffs = &fchip_coeffs_passthrough;
+            filter->active_sections = fchip_coeffs_passthrough.active_sections;
+        }
+        return -ENOMEM;
     }
 
-    fchip_calculate_convolution_table(filter);
+    fchip_coeff_cache_put(filter->coeffs);
+    filter->coeffs = coeffs;
+    filter->active_sections = coeffs->active_sections;
+    filter->params = coeffs->params;
+    return 0;
 }
 
+void fchip_filter_clear_buffers(struct fchip_channel_filter *filter){
+    // covers the TDF-II state as well
+    memset(filter->raw, 0, sizeof(filter->raw));
+    memset(filter->processed, 0, sizeof(filter->processed));
+
+    memset(filter->raw_q31, 0, sizeof(filter->raw_q31));
+    memset(filter->processed_q31, 0, sizeof(filter->processed_q31));
+    memset(filter->error_q31, 0, sizeof(filter->error_q31));
+}
+
+void fchip_filter_set_engine(struct fchip_channel_filter *filter, enum fchip_filter_engine engine)
+{
+    // the history of one engine means nothing to the other
+    if(filter->engine != engine){
+        filter->engine = engine;
+        fchip_filter_clear_buffers(filter);
+    }
+}
+
+void fchip_filter_set_rounding(struct fchip_channel_filter *filter, enum fchip_filter_rounding rounding)
+{
+    filter->rounding = rounding;
+    memset(filter->error_q31, 0, sizeof(filter->error_q31));
+}
+
+
+#define FCHIP_SELFTEST_FRAMES 2048
+#define FCHIP_SELFTEST_CHANNELS 2
+#define FCHIP_SELFTEST_BITS 24
+// in LSBs of a 24 bit sample (128 LSB ~ -96 dBFS). the engines round
+// differently in single precision, the difference grows with the 
+// section count and with poles close to the unit circle (low cutoff)
+#define FCHIP_SELFTEST_TOLERANCE 128
+
+int fchip_filter_selftest(void)
+{
+    static const enum fchip_filter_type types[] = {
+        FCHIP_FILTER_LOWPASS, FCHIP_FILTER_HIPASS, FCHIP_FILTER_BANDPASS,
+        FCHIP_FILTER_LR_LOWPASS, FCHIP_FILTER_LR_HIPASS,
+    };
+    // DF-I is the reference, the others are compared against it
+    static const enum fchip_filter_engine engines[] = {
+        FCHIP_ENGINE_DF1, FCHIP_ENGINE_TDF2, FCHIP_ENGINE_Q31,
+    };
+    static const char * const engine_names[] = { "DF-I", "TDF-II", "Q31" };
+    const int samples = FCHIP_SELFTEST_FRAMES * FCHIP_SELFTEST_CHANNELS;
+    const int bit_shift = 32 - FCHIP_SELFTEST_BITS;
+    const int sample_max_value = 1 << (FCHIP_SELFTEST_BITS - 1);
+    struct fchip_channel_filter *filters;
+    int32_t *df1, *data;
+    int t, e, sections, ch, i;
+    int max_diff, diff;
+    int err = 0;
+
+    filters = kcalloc(FCHIP_SELFTEST_CHANNELS * ARRAY_SIZE(engines), sizeof(*filters), GFP_KERNEL);
+    df1 = kmalloc_array(samples * ARRAY_SIZE(engines), sizeof(*df1), GFP_KERNEL);
+    if(!filters || !df1){
+        err = -ENOMEM;
+        goto out;
+    }
+
+    for(t = 0; t < ARRAY_SIZE(types); t++){
+        for(sections = 1; sections <= FCHIP_FILTER_MAX_SECTIONS; sections++){
+            for(ch = 0; ch < FCHIP_SELFTEST_CHANNELS * ARRAY_SIZE(engines); ch++){
+                fchip_filter_change_params(&filters[ch], types[t], 48000, 
+                    1000, sections, FCHIP_FILTER_Q_DEFAULT);
+                fchip_filter_set_engine(&filters[ch], engines[ch / FCHIP_SELFTEST_CHANNELS]);
+                fchip_filter_set_rounding(&filters[ch], FCHIP_ROUNDING_NEAREST);
+            }
+
+            // an impulse followed by a square wave, a crude but 
+            // broadband test signal
+            for(i = 0; i < samples; i++){
+                df1[i] = (i / FCHIP_SELFTEST_CHANNELS) % 96 < 48 ? 
+                    sample_max_value / 2 : -sample_max_value / 2;
+                df1[i] = i < FCHIP_SELFTEST_CHANNELS ? sample_max_value - 1 : df1[i];
+                df1[i] <<= bit_shift;
+            }
+            for(e = 1; e < ARRAY_SIZE(engines); e++){
+                memcpy(df1 + e * samples, df1, samples * sizeof(*df1));
+            }
+
+            fchip_fpu_begin();
+            for(e = 0; e < ARRAY_SIZE(engines); e++){
+                fchip_filter_process_interleaved(&filters[e * FCHIP_SELFTEST_CHANNELS], FCHIP_SELFTEST_CHANNELS, 
+                    df1 + e * samples, FCHIP_SELFTEST_FRAMES, bit_shift, sample_max_value);
+            }
+            fchip_fpu_end();
+
+            for(e = 1; e < ARRAY_SIZE(engines); e++){
+                data = df1 + e * samples;
+                max_diff = 0;
+                for(i = 0; i < samples; i++){
+                    diff = abs((df1[i] >> bit_shift) - (data[i] >> bit_shift));
+                    max_diff = max(max_diff, diff);
+                }
+
+                if(max_diff > FCHIP_SELFTEST_TOLERANCE){
+                    printk(KERN_ERR "fchip: filter selftest failed: type %d, %d sections, %s/%s differ by %d LSB\n",
+                        types[t], sections, engine_names[0], engine_names[e], max_diff);
+                    err = -EINVAL;
+                }
+            }
+        }
+    }
+
+    if(!err){
+        printk(KERN_INFO "fchip: filter selftest passed\n");
+    }
 
-inline fchip_float_t fchip_filter_process(
-    struct fchip_channel_filter* filter, 
-    fchip_float_t sample
+out:
+    kfree(df1);
+    for(ch = 0; filters && ch < FCHIP_SELFTEST_CHANNELS * ARRAY_SIZE(engines); ch++){
+        fchip_filter_release(&filters[ch]);
+    }
+    kfree(filters);
+    return err;
+}
+
+
+// DSP kernel dispatch. the kernels live in per-ISA translation units,
+// the best one supported by the boot CPU is picked once at module init
+static const struct fchip_filter_kernel *fchip_filter_kernel = &fchip_filter_kernel_generic;
+static const struct fchip_filter_kernel *fchip_filter_kernel_narrow = &fchip_filter_kernel_generic;
+
+void fchip_filter_select_kernel(void)
+{
+#ifdef CONFIG_X86
+    bool has_ymm = cpu_has_xfeatures(XFEATURE_MASK_SSE | XFEATURE_MASK_YMM, NULL);
+    bool has_zmm = cpu_has_xfeatures(XFEATURE_MASK_SSE | XFEATURE_MASK_YMM | 
+        XFEATURE_MASK_AVX512, NULL);
+
+    if(boot_cpu_has(X86_FEATURE_XMM4_1)){
+        fchip_filter_kernel = fchip_filter_kernel_narrow = &fchip_filter_kernel_sse41;
+    }
+    if(boot_cpu_has(X86_FEATURE_AVX2) && has_ymm){
+        fchip_filter_kernel = &fchip_filter_kernel_avx2;
+    }
+    if(boot_cpu_has(X86_FEATURE_AVX512F) && has_zmm){
+        fchip_filter_kernel = &fchip_filter_kernel_avx512;
+    }
+#endif
+    printk(KERN_INFO "fchip: using %s filter kernel (%s for narrow streams)\n",
+        fchip_filter_kernel->name, fchip_filter_kernel_narrow->name);
+}
+
+void fchip_filter_process_interleaved(
+    struct fchip_channel_filter *filters, 
+    int channels,
+    int32_t *data, 
+    unsigned long frames, 
+    int bit_shift, 
+    int sample_max_value
 )
 {
-    filter->raw[2] = filter->raw[1];
-    filter->raw[1] = filter->raw[0];
-    filter->raw[0] = sample;
+    // don't waste most of a wide vector on a stereo stream
+    const struct fchip_filter_kernel *kernel = 
+        channels <= fchip_filter_kernel_narrow->lanes ? fchip_filter_kernel_narrow : fchip_filter_kernel;
 
-    filter->processed[2] = filter->processed[1];
-    filter->processed[1] = filter->processed[0];
-    
-    filter->processed[0] = 
-        filter->coeffs.b0 * filter->raw[0]          // b0 * raw0 
-      + filter->coeffs.b1 * filter->raw[1]          // b1 * raw1
-      + filter->coeffs.b2 * filter->raw[2]          // b2 * raw2
+    if(!fchip_filter_needs_fpu(filters)){
+        fchip_filter_process_interleaved_q31(filters, channels, data, frames, bit_shift);
+        return;
+    }
 
-      - filter->coeffs.a1 * filter->processed[1]    // a1 * proc1
-      - filter->coeffs.a2 * filter->processed[2]    // a2 * proc2
-    ;
+    kernel->process_interleaved(filters, channels, data, frames, bit_shift, sample_max_value);
+}
+
+static void fchip_filter_bank_poll_user(struct fchip_filter_bank *bank);
+static void fchip_filter_bank_finish_ramp(struct fchip_filter_bank *bank);
 
-    return filter->processed[0];
+int fchip_filter_bank_init(struct fchip_filter_bank *bank, int count)
+{
+    memset(bank, 0, sizeof(*bank));
+    mutex_init(&bank->update_lock);
+    bank->filters = kcalloc(count, sizeof(*bank->filters), GFP_KERNEL);
+    if(!bank->filters){
+        return -ENOMEM;
+    }
+    bank->count = count;
+    return 0;
 }
 
-void fchip_filter_clear_buffers(struct fchip_channel_filter *filter){
-    for(int i = 0; i < 3; i++){
-        filter->raw[i] = 0;
-        filter->processed[i] = 0;
-    }   
+void fchip_filter_bank_free(struct fchip_filter_bank *bank)
+{
+    fchip_coeff_cache_put(xchg(&bank->pending, NULL));
+    fchip_coeff_cache_put(bank->target);
+    bank->target = NULL;
+    for(int i = 0; i < bank->count; i++){
+        fchip_filter_release(&bank->filters[i]);
+    }
+    kfree(bank->filters);
+    bank->filters = NULL;
+    bank->count = 0;
+}
+
+int fchip_filter_bank_update(
+    struct fchip_filter_bank *bank, 
+    enum fchip_filter_type filter_type, 
+    int cutoff_freq, 
+    int sections,
+    int q
+)
+{
+    struct fchip_filter_params params;
+    struct fchip_filter_coeffs *coeffs;
+    int err = 0;
+
+    mutex_lock(&bank->update_lock);
+    fchip_filter_resolve_params(&params, &bank->params, filter_type, 
+        FCHIP_FPARAM_SAMPLERATE_NOCHANGE, cutoff_freq, sections, q);
+    if(fchip_params_match(&params, &bank->params)){
+        goto unlock;
+    }
+
+    coeffs = fchip_coeff_cache_get(&params);
+    if(!coeffs){
+        err = -ENOMEM;
+        goto unlock;
+    }
+    // an update the data path hasn't picked up yet is simply replaced
+    fchip_coeff_cache_put(xchg(&bank->pending, coeffs));
+    bank->params = params;
+unlock:
+    mutex_unlock(&bank->update_lock);
+    return err;
+}
+
+// all the channels end up sharing one table: the first one computes 
+// it (or finds it cached), the rest are cache hits
+int fchip_filter_bank_change_params(
+    struct fchip_filter_bank *bank, 
+    enum fchip_filter_type filter_type, 
+    int sample_rate, 
+    int cutoff_freq, 
+    int sections,
+    int q
+)
+{
+    struct fchip_filter_coeffs *pending, *latest;
+    int err = 0, ret;
+
+    mutex_lock(&bank->update_lock);
+
+    // the stream is stopped: settle an unfinished live update, so 
+    // that the NOCHANGE parameters resolve to the latest ones
+    pending = xchg(&bank->pending, NULL);
+    latest = pending ?: bank->target;
+    for(int i = 0; latest && i < bank->count; i++){
+        bank->filters[i].params = latest->params;
+    }
+    fchip_coeff_cache_put(pending);
+    fchip_coeff_cache_put(bank->target);
+    bank->target = NULL;
+
+    for(int i = 0; i < bank->count; i++){
+        ret = fchip_filter_change_params(&bank->filters[i], filter_type, sample_rate, cutoff_freq, sections, q);
+        if(ret){
+            err = ret;
+        }
+    }
+
+    if(bank->count){
+        bank->params = bank->filters[0].params;
+    }
+
+    // an uploaded set outlives prepare: take it again right away, 
+    // without a ramp, the stream doesn't run yet
+    bank->user_seq = 0;
+    if(bank->user_slot && bank->count){
+        fchip_filter_bank_poll_user(bank);
+        if(bank->target){
+            fchip_filter_bank_finish_ramp(bank);
+        }
+    }
+    mutex_unlock(&bank->update_lock);
+    return err;
+}
+
+void fchip_filter_bank_set_engine(
+    struct fchip_filter_bank *bank, 
+    enum fchip_filter_engine engine, 
+    enum fchip_filter_rounding rounding
+)
+{
+    for(int i = 0; i < bank->count; i++){
+        fchip_filter_set_engine(&bank->filters[i], engine);
+        fchip_filter_set_rounding(&bank->filters[i], rounding);
+    }
+}
+
+// the stability region of a biquad in the (a1, a2) plane is a triangle,
+// i.e. convex: every point on the straight line between two stable 
+// sections is stable, so a linear ramp can't blow the filter up
+static void fchip_filter_interpolate(
+    struct fchip_filter_coeffs *out,
+    struct fchip_filter_coeffs *from,
+    struct fchip_filter_coeffs *to,
+    int pos,
+    bool fpu
+)
+{
+    struct fchip_conv_table_q31 *oq, *fq, *tq;
+
+    // only the table of the running engine is interpolated
+    if(fpu){
+        fchip_filter_interpolate_float(out, from, to, pos);
+        return;
+    }
+    for(int s = 0; s < out->active_sections; s++){
+        oq = &out->table_q31[s];
+        fq = &from->table_q31[s];
+        tq = &to->table_q31[s];
+
+        oq->b0 = fq->b0 + (s32)(((s64)tq->b0 - fq->b0) * pos >> FCHIP_FILTER_RAMP_SHIFT);
+        oq->b1 = fq->b1 + (s32)(((s64)tq->b1 - fq->b1) * pos >> FCHIP_FILTER_RAMP_SHIFT);
+        oq->b2 = fq->b2 + (s32)(((s64)tq->b2 - fq->b2) * pos >> FCHIP_FILTER_RAMP_SHIFT);
+        oq->a1 = fq->a1 + (s32)(((s64)tq->a1 - fq->a1) * pos >> FCHIP_FILTER_RAMP_SHIFT);
+        oq->a2 = fq->a2 + (s32)(((s64)tq->a2 - fq->a2) * pos >> FCHIP_FILTER_RAMP_SHIFT);
+    }
+}
+
+// takes over `next` and its reference. the ramp starts from 
+// whatever the filters run now, a previous ramp included
+static void fchip_filter_bank_start_ramp(struct fchip_filter_bank *bank, struct fchip_filter_coeffs *next)
+{
+    int i;
+
+    bank->ramp_from = *bank->filters[0].coeffs;
+    bank->ramp = bank->ramp_from;
+    bank->ramp.cached = false;
+    // unused sections are identity ones, ramping over the longer 
+    // cascade works for both ends
+    bank->ramp.active_sections = max(bank->ramp_from.active_sections, next->active_sections);
+    bank->ramp_pos = 0;
+
+    for(i = 0; i < bank->count; i++){
+        fchip_coeff_cache_put(bank->filters[i].coeffs);
+        bank->filters[i].coeffs = &bank->ramp;
+        bank->filters[i].active_sections = bank->ramp.active_sections;
+    }
+    fchip_coeff_cache_put(bank->target);
+    bank->target = next;
+}
+
+static void fchip_filter_bank_finish_ramp(struct fchip_filter_bank *bank)
+{
+    struct fchip_filter_coeffs *target = bank->target;
+    int i;
+
+    // the bank's reference goes to the first filter
+    fchip_coeff_cache_hold(target, bank->count - 1);
+    for(i = 0; i < bank->count; i++){
+        bank->filters[i].coeffs = target;
+        bank->filters[i].active_sections = target->active_sections;
+        bank->filters[i].params = target->params;
+    }
+    bank->target = NULL;
+}
+
+// takes over a set uploaded to the bank's hwdep slot. only plain 
+// loads and one copy: never waits for the writer, a torn copy is 
+// dropped and the slot is looked at again with the next block
+static void fchip_filter_bank_poll_user(struct fchip_filter_bank *bank)
+{
+    struct fchip_filter_user_slot *slot = bank->user_slot;
+    struct fchip_filter_user_set *set;
+    struct fchip_filter_coeffs *coeffs;
+    u32 seq = smp_load_acquire(&slot->seq);
+    u32 sections;
+    int i;
+
+    if(likely(seq == bank->user_seq)){
+        return;
+    }
+
+    set = &slot->set[seq & 1];
+    sections = READ_ONCE(set->sections);
+    if(!sections || sections > FCHIP_FILTER_MAX_SECTIONS){
+        // an empty (or broken) set leaves the filters alone
+        bank->user_seq = seq;
+        return;
+    }
+
+    coeffs = &bank->user[bank->user_idx ^ 1];
+    memcpy(coeffs->table, set->table, sections * sizeof(set->table[0]));
+    memcpy(coeffs->table_q31, set->table_q31, sections * sizeof(set->table_q31[0]));
+    smp_rmb();
+    if(READ_ONCE(slot->seq) != seq){
+        return;
+    }
+
+    for(i = sections; i < FCHIP_FILTER_MAX_SECTIONS; i++){
+        coeffs->table[i] = fchip_coeffs_passthrough.table[i];
+        coeffs->table_q31[i] = fchip_coeffs_passthrough.table_q31[i];
+    }
+    coeffs->active_sections = sections;
+    // the mixer parameters stay what NOCHANGE resolves to
+    coeffs->params = bank->filters[0].params;
+    coeffs->cached = false;
+
+    bank->user_idx ^= 1;
+    bank->user_seq = seq;
+    fchip_filter_bank_start_ramp(bank, coeffs);
+}
+
+// advances the ramp by `frames` and sets the coefficients for them
+static void fchip_filter_bank_ramp(struct fchip_filter_bank *bank, int frames, bool fpu)
+{
+    bank->ramp_pos += frames;
+    if(bank->ramp_pos >= FCHIP_FILTER_RAMP_FRAMES){
+        fchip_filter_bank_finish_ramp(bank);
+        return;
+    }
+    fchip_filter_interpolate(&bank->ramp, &bank->ramp_from, bank->target, bank->ramp_pos, fpu);
+}
+
+void fchip_filter_process_block(
+    struct fchip_filter_bank *bank, 
+    int32_t *interleaved, 
+    unsigned long frames, 
+    int channels, 
+    int bit_shift
+)
+{
+    // the engine is the same for the whole bank
+    bool fpu = fchip_filter_needs_fpu(bank->filters);
+    // signed only; hda spec does not say anything about unsigned -> bit_depth-1
+    int sample_max_value = 1 << (31 - bit_shift);
+    int step;
+
+    if(WARN_ON_ONCE(channels > bank->count)){
+        return;
+    }
+    // the callers check fchip_filter_bank_runnable: this only keeps 
+    // the FPU state of an interrupted kernel FPU section intact
+    if(fpu && WARN_ON_ONCE(!fchip_fpu_usable())){
+        return;
+    }
+
+    // no lock here: a live update is a single pointer exchange.
+    // the bookkeeping is integer only and stays out of the FPU section
+    if(unlikely(READ_ONCE(bank->pending))){
+        fchip_filter_bank_start_ramp(bank, xchg(&bank->pending, NULL));
+    }
+    if(bank->user_slot){
+        fchip_filter_bank_poll_user(bank);
+    }
+
+    // one FPU section per block: saving the FPU state
+    // per sample would cost more than the filtering itself
+    if(fpu){
+        fchip_fpu_begin();
+    }
+    while(unlikely(bank->target) && frames){
+        step = min_t(unsigned long, frames, FCHIP_FILTER_RAMP_STEP);
+        fchip_filter_bank_ramp(bank, step, fpu);
+        fchip_filter_process_interleaved(bank->filters, channels, interleaved, step, 
+            bit_shift, sample_max_value);
+        interleaved += step * channels;
+        frames -= step;
+    }
+
+    if(frames){
+        fchip_filter_process_interleaved(bank->filters, channels, interleaved, frames, 
+            bit_shift, sample_max_value);
+    }
+    if(fpu){
+        fchip_fpu_end();
+    }
 }
\ No newline at end of file
@@ -1,8 +1,39 @@
 #pragma once
+#include <linux/types.h>
+#include <linux/list.h>
+#include <linux/atomic.h>
+#include <linux/mutex.h>
 
+#ifdef CONFIG_X86
+#include <asm/fpu/api.h>
+#define fchip_fpu_begin()	kernel_fpu_begin()
+#define fchip_fpu_end()		kernel_fpu_end()
+// false in an interrupt that came in while the kernel used the FPU
+#define fchip_fpu_usable()	irq_fpu_usable()
+#else
+#define fchip_fpu_begin()	/* NOP */
+#define fchip_fpu_end()		/* NOP */
+#define fchip_fpu_usable()	true
+#endif
+
+// only fchip_filter_fpu.c and the DSP kernels are built with FPU
+// flags (see the Makefile), so the interface takes integers and
+// those objects are only entered inside fchip_fpu_begin/end
 #define FCHIP_FPARAM_FILTERTYPE_NOCHANGE -1
-#define FCHIP_FPARAM_SAMPLERATE_NOCHANGE -1.0f
-#define FCHIP_FPARAM_CUTOFF_NOCHANGE -1.0f
+#define FCHIP_FPARAM_SAMPLERATE_NOCHANGE -1
+#define FCHIP_FPARAM_CUTOFF_NOCHANGE -1
+#define FCHIP_FPARAM_SECTIONS_NOCHANGE -1
+#define FCHIP_FPARAM_Q_NOCHANGE -1
+
+// the Q of lowpass/hipass sections and of the bandpass is given in 
+// 1/FCHIP_FILTER_Q_SCALE. FCHIP_FILTER_Q_DEFAULT keeps the Butterworth
+// alignment of a cascade (and the quarter-of-cutoff bandpass width)
+#define FCHIP_FILTER_Q_SCALE 100
+#define FCHIP_FILTER_Q_DEFAULT 0
+#define FCHIP_FILTER_Q_MAX (20 * FCHIP_FILTER_Q_SCALE)
+
+// up to 8th order (4 cascaded second-order sections)
+#define FCHIP_FILTER_MAX_SECTIONS 4
 
 typedef float fchip_float_t;
 
@@ -11,9 +42,31 @@ enum fchip_filter_type{
     FCHIP_FILTER_LOWPASS,
     FCHIP_FILTER_HIPASS,
     FCHIP_FILTER_BANDPASS,
-    FCHIP_FILTER_MUTE
+    FCHIP_FILTER_MUTE,
+    FCHIP_FILTER_LR_LOWPASS,    // Linkwitz-Riley, even section count only
+    FCHIP_FILTER_LR_HIPASS
+};
+
+// the structure the sections are computed with. both engines
+// use the same coefficients and give the same output up to
+// rounding (see fchip_filter_selftest)
+enum fchip_filter_engine{
+    FCHIP_ENGINE_DF1,   // direct form I: 2 inputs + 2 outputs of history 
+    FCHIP_ENGINE_TDF2,  // transposed direct form II: 2 state words, no shifting
+    FCHIP_ENGINE_Q31    // direct form I in fixed point, needs no FPU
+};
+
+// how the fixed point engine requantizes its 64 bit accumulators
+enum fchip_filter_rounding{
+    FCHIP_ROUNDING_TRUNCATE,        // arithmetic shift, cheapest, biased
+    FCHIP_ROUNDING_NEAREST,         // round half up
+    FCHIP_ROUNDING_ERROR_FEEDBACK   // the truncation error is fed into the next sample
 };
 
+// Q31 coefficients carry a post-shift of 1 (Q1.30 effectively), 
+// as the feedback coefficients of a biquad reach +-2
+#define FCHIP_Q31_POSTSHIFT 1
+
 // a biquad convolution table is used 
 // in the current implementation
 struct fchip_conv_table
@@ -26,20 +79,186 @@ struct fchip_conv_table
     fchip_float_t a2;
 };
 
-struct fchip_channel_filter
+// fchip_conv_table converted for FCHIP_ENGINE_Q31
+struct fchip_conv_table_q31
 {
-    struct fchip_conv_table coeffs;
-    fchip_float_t raw[3];
-    fchip_float_t processed[3];
+    s32 b0;
+    s32 b1;
+    s32 b2;
 
+    s32 a1;
+    s32 a2;
+};
+
+// everything the coefficients are computed from
+struct fchip_filter_params
+{
     enum fchip_filter_type filter_type;
     int sample_rate;
-    fchip_float_t cutoff_freq;
+    int cutoff_freq;
+    int sections;   // requested
+    int q;          // in 1/FCHIP_FILTER_Q_SCALE
+};
+
+// the coefficients of one parameter set. they are computed once, kept 
+// in a small per-module cache and shared read-only by every channel 
+// and stream using the same parameters; filters only own their history
+struct fchip_filter_coeffs
+{
+    // second-order sections, applied one after another 
+    struct fchip_conv_table table[FCHIP_FILTER_MAX_SECTIONS];
+    struct fchip_conv_table_q31 table_q31[FCHIP_FILTER_MAX_SECTIONS];
+    int active_sections;
+
+    struct fchip_filter_params params;  // cache key
+
+    struct list_head node;  // cache LRU, most recently used first
+    atomic_t users;         // references; only the cache lock frees at 0
+    bool cached;            // false for the pass-through and ramp tables
+};
+
+struct fchip_channel_filter
+{
+    struct fchip_filter_coeffs *coeffs;     // shared, never written through
+    union {
+        // FCHIP_ENGINE_DF1
+        struct {
+            fchip_float_t raw[FCHIP_FILTER_MAX_SECTIONS][3];
+            fchip_float_t processed[FCHIP_FILTER_MAX_SECTIONS][3];
+        };
+        // FCHIP_ENGINE_TDF2
+        fchip_float_t state[FCHIP_FILTER_MAX_SECTIONS][2];
+        // FCHIP_ENGINE_Q31
+        struct {
+            s32 raw_q31[FCHIP_FILTER_MAX_SECTIONS][2];
+            s32 processed_q31[FCHIP_FILTER_MAX_SECTIONS][2];
+            s64 error_q31[FCHIP_FILTER_MAX_SECTIONS];
+        };
+    };
+    enum fchip_filter_engine engine;
+    enum fchip_filter_rounding rounding;
+    int active_sections;    // used for processing; depends on the filter type
+
+    struct fchip_filter_params params;
+};
+
+// a coefficient set designed in userspace and uploaded through the 
+// hwdep device (fchip_hwdep.h); part of its ABI, hence the fixed types
+struct fchip_filter_user_set
+{
+    u32 sections;   // 1..FCHIP_FILTER_MAX_SECTIONS, 0 for none
+    u32 reserved;
+    struct fchip_conv_table table[FCHIP_FILTER_MAX_SECTIONS];
+    struct fchip_conv_table_q31 table_q31[FCHIP_FILTER_MAX_SECTIONS];
+};
+
+// double buffered: the writer fills set[(seq + 1) & 1] and then 
+// increments seq with release semantics; the data path copies 
+// set[seq & 1] and drops the copy if seq moved in the meantime
+struct fchip_filter_user_slot
+{
+    u32 seq;
+    u32 reserved;
+    struct fchip_filter_user_set set[2];
+};
+
+// length of the coefficient ramp after a live parameter change
+// and the granularity it is done at (both in frames)
+#define FCHIP_FILTER_RAMP_SHIFT 8
+#define FCHIP_FILTER_RAMP_FRAMES (1 << FCHIP_FILTER_RAMP_SHIFT)
+#define FCHIP_FILTER_RAMP_STEP 16
+
+// the filters of one stream, one per channel
+struct fchip_filter_bank
+{
+    struct fchip_channel_filter *filters;
+    int count;      // allocated filters, i.e. max channels
+
+    // live parameter updates, see fchip_filter_bank_update. the writer
+    // publishes a coefficient set in `pending`, the data path takes it
+    // over at the start of the next block and ramps towards it
+    struct mutex update_lock;   // serializes the writers
+    struct fchip_filter_params params;      // latest requested, under update_lock
+    struct fchip_filter_coeffs *pending;    // exchanged atomically
+
+    // data path only
+    struct fchip_filter_coeffs *target;     // the bank's reference while ramping
+    struct fchip_filter_coeffs ramp_from;
+    struct fchip_filter_coeffs ramp;        // what the filters run while ramping
+    int ramp_pos;
+
+    // uploaded coefficients, polled at the start of every block.
+    // user[] alternate, so that the copy never overwrites the set 
+    // the filters run
+    struct fchip_filter_user_slot *user_slot;   // NULL without hwdep
+    u32 user_seq;   // last seq taken over, 0 to take the slot again
+    struct fchip_filter_coeffs user[2];
+    int user_idx;
 };
 
 
-struct fchip_channel_filter* fchip_filter_create(enum fchip_filter_type filter_type, int sample_rate, fchip_float_t cutoff_freq);
-void fchip_filter_change_params(struct fchip_channel_filter *filter, enum fchip_filter_type filter_type, fchip_float_t sample_rate, fchip_float_t cutoff_freq);
+struct fchip_channel_filter* fchip_filter_create(enum fchip_filter_type filter_type, int sample_rate, int cutoff_freq, int sections);
+void fchip_filter_destroy(struct fchip_channel_filter *filter);
+// returns -ENOMEM if the coefficients couldn't be allocated; the filter
+// keeps its previous coefficients then (or passes the signal through)
+int fchip_filter_change_params(struct fchip_channel_filter *filter, enum fchip_filter_type filter_type, int sample_rate, int cutoff_freq, int sections, int q);
+
+// single sample reference path; far too slow for the data path, 
+// use fchip_filter_process_block there. FPU section only
+fchip_float_t fchip_filter_process(struct fchip_channel_filter* filter, fchip_float_t sample);
+void fchip_filter_clear_buffers(struct fchip_channel_filter *filter);
+void fchip_filter_set_engine(struct fchip_channel_filter *filter, enum fchip_filter_engine engine);
+void fchip_filter_set_rounding(struct fchip_channel_filter *filter, enum fchip_filter_rounding rounding);
+// drops the reference to the shared coefficients
+void fchip_filter_release(struct fchip_channel_filter *filter);
+
+// frees the coefficient cache, call at module exit
+void fchip_filter_cache_free(void);
+
+static inline bool fchip_filter_needs_fpu(struct fchip_channel_filter *filter)
+{
+    return filter->engine != FCHIP_ENGINE_Q31;
+}
+
+// whether the bank can run in the current context. the pointer callback
+// runs in hardirq context too; an interrupt that landed in another 
+// kernel FPU section must not take the FPU, the float engines wait for
+// the next call then
+static inline bool fchip_filter_bank_runnable(struct fchip_filter_bank *bank)
+{
+    return !fchip_filter_needs_fpu(bank->filters) || fchip_fpu_usable();
+}
+
+// runs every engine over the same test signal and checks that
+// their outputs match DF-I. returns 0 on success
+int fchip_filter_selftest(void);
+
+// picks the DSP kernel for the boot CPU, call once at module init
+void fchip_filter_select_kernel(void);
+
+int fchip_filter_bank_init(struct fchip_filter_bank *bank, int count);
+void fchip_filter_bank_free(struct fchip_filter_bank *bank);
+int fchip_filter_bank_change_params(struct fchip_filter_bank *bank, enum fchip_filter_type filter_type, int sample_rate, int cutoff_freq, int sections, int q);
+void fchip_filter_bank_set_engine(struct fchip_filter_bank *bank, enum fchip_filter_engine engine, enum fchip_filter_rounding rounding);
+// changes the parameters of a running stream without a lock on the data 
+// path; the rate is kept. the new coefficients are faded in over
+// FCHIP_FILTER_RAMP_FRAMES. process context only
+int fchip_filter_bank_update(struct fchip_filter_bank *bank, enum fchip_filter_type filter_type, int cutoff_freq, int sections, int q);
+
+// filters `frames` interleaved frames of `channels` samples in place,
+// MSB-justified with `bit_shift` unused low bits. takes care of the 
+// FPU section; the filter state is kept in registers for the whole
+// block and written back once at the end
+void fchip_filter_process_block(struct fchip_filter_bank *bank, int32_t *interleaved, 
+    unsigned long frames, int channels, int bit_shift);
+
+// vectorized kernel: filters `frames` interleaved frames of `channels` 
+// samples in place. the caller is responsible for the FPU section
+// (see fchip_filter_needs_fpu)
+void fchip_filter_process_interleaved(struct fchip_channel_filter *filters, int channels,
+    int32_t *data, unsigned long frames, int bit_shift, int sample_max_value);
 
-inline fchip_float_t fchip_filter_process(struct fchip_channel_filter* filter, fchip_float_t sample);
-void fchip_filter_clear_buffers(struct fchip_channel_filter *filter);
\ No newline at end of file
+// fixed point engine (fchip_filter_q31.c), integer only
+s32 fchip_filter_process_q31(struct fchip_channel_filter *filter, s32 sample);
+void fchip_filter_process_interleaved_q31(struct fchip_channel_filter *filters, int channels,
+    int32_t *data, unsigned long frames, int bit_shift);
\ No newline at end of file
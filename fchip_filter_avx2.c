@@ -0,0 +1,5 @@
+// AVX2 kernel: 8 channels per ymm register (one 7.1 frame)
+#define FCHIP_FILTER_LANES 8
+#define FCHIP_FILTER_KERNEL fchip_filter_kernel_avx2
+
+#include "fchip_filter_kernel_template.h"
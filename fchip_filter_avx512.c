@@ -0,0 +1,5 @@
+// AVX-512 kernel: 16 channels per zmm register
+#define FCHIP_FILTER_LANES 16
+#define FCHIP_FILTER_KERNEL fchip_filter_kernel_avx512
+
+#include "fchip_filter_kernel_template.h"
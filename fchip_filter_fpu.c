@@ -0,0 +1,306 @@
+// the floating point half of the filter: coefficient math, ramp 
+// interpolation and the single sample reference path. this object and
+// the DSP kernels are the only ones built with FPU flags; everything 
+// in here runs inside a fchip_fpu_begin/fchip_fpu_end section
+#include <linux/kernel.h>
+#include <linux/limits.h>
+#include <linux/minmax.h>
+#include "fchip_filter.h"
+#include "fchip_filter_kernel.h"
+
+#define M_PI 3.14159265358979323846f
+#define M_SQRT1_2 0.707106781186548f
+
+// quality factors of the second-order sections of a Butterworth
+// filter of order 2*sections: Q_k = 1/(2cos((2k+1)pi/(4*sections))).
+// there's no cos in the kernel, so the table is precomputed
+static const fchip_float_t fchip_butterworth_q[FCHIP_FILTER_MAX_SECTIONS][FCHIP_FILTER_MAX_SECTIONS] = {
+    { M_SQRT1_2 },                                          // 2nd order
+    { 0.541196100f, 1.306562965f },                         // 4th order
+    { 0.517638090f, M_SQRT1_2, 1.931851653f },              // 6th order
+    { 0.509795579f, 0.601344887f, 0.899976223f, 2.562915448f }, // 8th order
+};
+
+static fchip_float_t fchip_filter_transform_frequency(fchip_float_t sample_rate, fchip_float_t freq){
+    // the original filter had a tan function here.
+    // an approximation is used here: tan(x) ~ x + (x^3)/3 
+    fchip_float_t f = freq * M_PI / sample_rate;
+    return f + (f * f * f) / 3;
+}
+
+// quality factor of the section `idx` out of `sections`
+static fchip_float_t fchip_filter_section_q(struct fchip_filter_params *params, int idx, int sections)
+{
+    switch(params->filter_type){
+        case FCHIP_FILTER_LR_LOWPASS:
+        case FCHIP_FILTER_LR_HIPASS:
+            // Linkwitz-Riley of order 2*sections is a Butterworth 
+            // of order `sections`, applied twice
+            return fchip_butterworth_q[sections/2 - 1][idx % (sections/2)];
+        default:
+            // an explicit Q applies to every section of the cascade
+            if(params->q != FCHIP_FILTER_Q_DEFAULT){
+                return (fchip_float_t)params->q / FCHIP_FILTER_Q_SCALE;
+            }
+            return fchip_butterworth_q[sections - 1][idx];
+    }
+}
+
+static void fchip_calculate_section(
+    struct fchip_filter_params *params,
+    struct fchip_conv_table *coeffs,
+    fchip_float_t q
+)
+{
+    fchip_float_t w;
+    fchip_float_t d, w1, w2, w0sqr, wd; // for bandpass filter
+    fchip_float_t a0, a1, a2, b0, b1, b2;
+    switch(params->filter_type){
+        case FCHIP_FILTER_LOWPASS:
+        case FCHIP_FILTER_LR_LOWPASS:
+            w = fchip_filter_transform_frequency(params->sample_rate, params->cutoff_freq);
+            
+            a0 = 1 + w/q + w*w;
+            a1 = -2 + 2*w*w;
+            a2 = 1 - w/q + w*w;
+
+            b0 = w*w;
+            b1 = 2*w*w;
+            b2 = w*w;
+    
+            break;
+
+        case FCHIP_FILTER_HIPASS:
+        case FCHIP_FILTER_LR_HIPASS:
+            w = fchip_filter_transform_frequency(params->sample_rate, params->cutoff_freq);
+            
+            a0 = 1 + w/q + w*w;
+            a1 = -2 + 2*w*w;
+            a2 = 1 - w/q + w*w;
+            
+            b0 = 1;
+            b1 = -2;
+            b2 = 1;
+            break;
+
+        case FCHIP_FILTER_BANDPASS:
+            w = params->cutoff_freq;
+            
+            // band width
+            d = params->q != FCHIP_FILTER_Q_DEFAULT ? 
+                w * FCHIP_FILTER_Q_SCALE / params->q : w/4;
+            w1 = (w-d) > 0 ? (w-d) : 0;
+            w1 = fchip_filter_transform_frequency(params->sample_rate, w1);
+            w2 = (w+d) < params->sample_rate ? (w+d) : params->sample_rate;
+            w2 = fchip_filter_transform_frequency(params->sample_rate, w2);
+
+            w0sqr = w1*w2;
+            wd = w2-w1;
+
+            a0 = -1 - wd - w0sqr;
+            a1 = 2 - 2*w0sqr;
+            a2 = -1 + wd - w0sqr;
+            
+            b0 = -wd;
+            b1 = 0;
+            b2 = wd;
+            break;
+        case FCHIP_FILTER_MUTE:
+            b0 = 0;
+            b1 = 0;
+            b2 = 0;
+            
+            a0 = 1;
+            a1 = 0;
+            a2 = 0;
+            break;
+
+        // case FCHIP_FILTER_NONE:
+        default:
+            b0 = 1;
+            b1 = 0;
+            b2 = 0;
+            
+            a0 = 1;
+            a1 = 0;
+            a2 = 0;
+
+    }
+    coeffs->b0 = b0 / a0;
+    coeffs->b1 = b1 / a0;
+    coeffs->b2 = b2 / a0;
+
+    coeffs->a1 = a1 / a0;
+    coeffs->a2 = a2 / a0;
+}
+
+static s32 fchip_float_to_q31(fchip_float_t value)
+{
+    // the post-shift halves the coefficients, so [-2, 2) fits
+    value *= (fchip_float_t)(1u << (31 - FCHIP_Q31_POSTSHIFT));
+    if(value >= (fchip_float_t)S32_MAX){
+        return S32_MAX;
+    }
+    if(value <= (fchip_float_t)S32_MIN){
+        return S32_MIN;
+    }
+    return (s32)value;
+}
+
+static void fchip_convert_section_q31(struct fchip_conv_table *coeffs, struct fchip_conv_table_q31 *coeffs_q31)
+{
+    coeffs_q31->b0 = fchip_float_to_q31(coeffs->b0);
+    coeffs_q31->b1 = fchip_float_to_q31(coeffs->b1);
+    coeffs_q31->b2 = fchip_float_to_q31(coeffs->b2);
+
+    coeffs_q31->a1 = fchip_float_to_q31(coeffs->a1);
+    coeffs_q31->a2 = fchip_float_to_q31(coeffs->a2);
+}
+
+void fchip_calculate_convolution_table(
+    struct fchip_filter_coeffs *coeffs
+)
+{
+    static const struct fchip_conv_table identity = { .b0 = 1 };
+    struct fchip_filter_params *params = &coeffs->params;
+    int sections = params->sections;
+    int i;
+
+    switch(params->filter_type){
+        case FCHIP_FILTER_LOWPASS:
+        case FCHIP_FILTER_HIPASS:
+            break;
+        case FCHIP_FILTER_LR_LOWPASS:
+        case FCHIP_FILTER_LR_HIPASS:
+            // made of pairs of identical sections
+            sections = round_up(sections, 2);
+            break;
+        default:
+            // a single section describes the filter completely
+            sections = 1;
+    }
+    coeffs->active_sections = sections;
+
+    for(i = 0; i < sections; i++){
+        fchip_calculate_section(params, &coeffs->table[i], 
+            fchip_filter_section_q(params, i, sections));
+    }
+    // unused sections pass the signal through, so that the channels of
+    // a vector with different section counts can run the same cascade
+    for(; i < FCHIP_FILTER_MAX_SECTIONS; i++){
+        coeffs->table[i] = identity;
+    }
+
+    for(i = 0; i < FCHIP_FILTER_MAX_SECTIONS; i++){
+        fchip_convert_section_q31(&coeffs->table[i], &coeffs->table_q31[i]);
+    }
+}
+
+// the floating point side of fchip_filter_interpolate
+void fchip_filter_interpolate_float(
+    struct fchip_filter_coeffs *out,
+    struct fchip_filter_coeffs *from,
+    struct fchip_filter_coeffs *to,
+    int pos
+)
+{
+    struct fchip_conv_table *o, *f, *t;
+    fchip_float_t x = (fchip_float_t)pos / FCHIP_FILTER_RAMP_FRAMES;
+
+    for(int s = 0; s < out->active_sections; s++){
+        o = &out->table[s];
+        f = &from->table[s];
+        t = &to->table[s];
+
+        o->b0 = f->b0 + (t->b0 - f->b0) * x;
+        o->b1 = f->b1 + (t->b1 - f->b1) * x;
+        o->b2 = f->b2 + (t->b2 - f->b2) * x;
+        o->a1 = f->a1 + (t->a1 - f->a1) * x;
+        o->a2 = f->a2 + (t->a2 - f->a2) * x;
+    }
+}
+
+static inline fchip_float_t fchip_filter_process_df1(
+    struct fchip_channel_filter* filter, 
+    fchip_float_t sample
+)
+{
+    fchip_float_t *raw, *processed;
+
+    for(int s = 0; s < filter->active_sections; s++){
+        raw = filter->raw[s];
+        processed = filter->processed[s];
+
+        raw[2] = raw[1];
+        raw[1] = raw[0];
+        raw[0] = sample;
+
+        processed[2] = processed[1];
+        processed[1] = processed[0];
+        
+        processed[0] = 
+            filter->coeffs->table[s].b0 * raw[0]          // b0 * raw0 
+          + filter->coeffs->table[s].b1 * raw[1]          // b1 * raw1
+          + filter->coeffs->table[s].b2 * raw[2]          // b2 * raw2
+
+          - filter->coeffs->table[s].a1 * processed[1]    // a1 * proc1
+          - filter->coeffs->table[s].a2 * processed[2]    // a2 * proc2
+        ;
+
+        // the output of a section is the input of the next one
+        sample = processed[0];
+    }
+
+    return sample;
+}
+
+static inline fchip_float_t fchip_filter_process_tdf2(
+    struct fchip_channel_filter* filter, 
+    fchip_float_t sample
+)
+{
+    struct fchip_conv_table *c;
+    fchip_float_t *state;
+    fchip_float_t processed;
+
+    for(int s = 0; s < filter->active_sections; s++){
+        c = &filter->coeffs->table[s];
+        state = filter->state[s];
+
+        processed = c->b0 * sample + state[0];
+        state[0] = c->b1 * sample - c->a1 * processed + state[1];
+        state[1] = c->b2 * sample - c->a2 * processed;
+
+        sample = processed;
+    }
+
+    return sample;
+}
+
+#define FCHIP_Q31_ONE ((fchip_float_t)(1u << 31))
+
+static inline s32 fchip_sample_to_q31(fchip_float_t sample)
+{
+    sample *= FCHIP_Q31_ONE;
+    if(sample >= (fchip_float_t)S32_MAX){
+        return S32_MAX;
+    }
+    if(sample <= (fchip_float_t)S32_MIN){
+        return S32_MIN;
+    }
+    return (s32)sample;
+}
+
+fchip_float_t fchip_filter_process(
+    struct fchip_channel_filter* filter, 
+    fchip_float_t sample
+)
+{
+    if(filter->engine == FCHIP_ENGINE_TDF2){
+        return fchip_filter_process_tdf2(filter, sample);
+    }
+    if(filter->engine == FCHIP_ENGINE_Q31){
+        return fchip_filter_process_q31(filter, fchip_sample_to_q31(sample)) / FCHIP_Q31_ONE;
+    }
+    return fchip_filter_process_df1(filter, sample);
+}
\ No newline at end of file
@@ -0,0 +1,6 @@
+// baseline kernel, no wider ISA than the FPU flags of the architecture.
+// one channel per "vector" - this is the plain scalar loop
+#define FCHIP_FILTER_LANES 1
+#define FCHIP_FILTER_KERNEL fchip_filter_kernel_generic
+
+#include "fchip_filter_kernel_template.h"
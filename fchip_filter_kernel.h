@@ -0,0 +1,23 @@
+#pragma once
+#include "fchip_filter.h"
+
+// a DSP kernel built for one instruction set. see fchip_filter_select_kernel
+struct fchip_filter_kernel
+{
+    const char *name;
+    int lanes;  // channels processed per vector
+    void (*process_interleaved)(struct fchip_channel_filter *filters, int channels,
+        int32_t *data, unsigned long frames, int bit_shift, int sample_max_value);
+};
+
+extern const struct fchip_filter_kernel fchip_filter_kernel_generic;
+#ifdef CONFIG_X86
+extern const struct fchip_filter_kernel fchip_filter_kernel_sse41;
+extern const struct fchip_filter_kernel fchip_filter_kernel_avx2;
+extern const struct fchip_filter_kernel fchip_filter_kernel_avx512;
+#endif
+
+// fchip_filter_fpu.c, FPU section only
+void fchip_calculate_convolution_table(struct fchip_filter_coeffs *coeffs);
+void fchip_filter_interpolate_float(struct fchip_filter_coeffs *out, struct fchip_filter_coeffs *from,
+    struct fchip_filter_coeffs *to, int pos);
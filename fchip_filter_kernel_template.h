@@ -0,0 +1,294 @@
+#pragma once
+// body of the interleaved filter kernel, shared by the per-ISA
+// translation units. each of them defines FCHIP_FILTER_LANES and
+// FCHIP_FILTER_KERNEL (the name of the exported kernel descriptor)
+// and is built with its own -m flags, see the Makefile.
+//
+// GCC vector extensions are used instead of the intrinsics headers,
+// the per-object flags decide which instructions are emitted.
+// one lane = one channel, so a single vector holds a group of
+// FCHIP_FILTER_LANES interleaved channels of the same frame.
+#include <linux/compiler.h>
+#include <linux/minmax.h>
+#include <linux/string.h>
+#include <linux/stringify.h>
+#include "fchip_filter_kernel.h"
+
+#if !defined(FCHIP_FILTER_LANES) || !defined(FCHIP_FILTER_KERNEL)
+#error "FCHIP_FILTER_LANES and FCHIP_FILTER_KERNEL must be defined"
+#endif
+
+typedef fchip_float_t fchip_vfloat_t __attribute__((vector_size(FCHIP_FILTER_LANES*sizeof(fchip_float_t))));
+typedef int32_t fchip_vint_t __attribute__((vector_size(FCHIP_FILTER_LANES*sizeof(int32_t))));
+
+// one second-order section for FCHIP_FILTER_LANES channels
+struct fchip_filter_lane_section
+{
+    fchip_vfloat_t b0, b1, b2, a1, a2;
+    union {
+        // FCHIP_ENGINE_DF1
+        struct {
+            fchip_vfloat_t raw1, raw2;
+            fchip_vfloat_t processed1, processed2;
+        };
+        // FCHIP_ENGINE_TDF2
+        struct {
+            fchip_vfloat_t s1, s2;
+        };
+    };
+};
+
+// all the lanes of a group run the same engine
+struct fchip_filter_lane_group
+{
+    struct fchip_filter_lane_section sections[FCHIP_FILTER_MAX_SECTIONS];
+    int section_count;
+    enum fchip_filter_engine engine;
+};
+
+static void fchip_filter_group_load(
+    struct fchip_filter_lane_group *group, 
+    struct fchip_channel_filter *filters, 
+    int lanes
+)
+{
+    struct fchip_filter_lane_section *sec;
+    int lane, s;
+
+    memset(group, 0, sizeof(*group));
+    group->engine = filters[0].engine;
+    for(lane = 0; lane < lanes; lane++){
+        // unused sections are identity ones, so the lanes
+        // can simply run the longest cascade of the group
+        group->section_count = max(group->section_count, filters[lane].active_sections);
+
+        for(s = 0; s < FCHIP_FILTER_MAX_SECTIONS; s++){
+            sec = &group->sections[s];
+            sec->b0[lane] = filters[lane].coeffs->table[s].b0;
+            sec->b1[lane] = filters[lane].coeffs->table[s].b1;
+            sec->b2[lane] = filters[lane].coeffs->table[s].b2;
+            sec->a1[lane] = filters[lane].coeffs->table[s].a1;
+            sec->a2[lane] = filters[lane].coeffs->table[s].a2;
+
+            // history in the layout fchip_filter_process leaves it
+            if(group->engine == FCHIP_ENGINE_TDF2){
+                sec->s1[lane] = filters[lane].state[s][0];
+                sec->s2[lane] = filters[lane].state[s][1];
+                continue;
+            }
+            sec->raw1[lane] = filters[lane].raw[s][0];
+            sec->raw2[lane] = filters[lane].raw[s][1];
+            sec->processed1[lane] = filters[lane].processed[s][0];
+            sec->processed2[lane] = filters[lane].processed[s][1];
+        }
+    }
+}
+
+static void fchip_filter_group_store(
+    struct fchip_filter_lane_group *group, 
+    struct fchip_channel_filter *filters, 
+    int lanes
+)
+{
+    struct fchip_filter_lane_section *sec;
+    int lane, s;
+
+    for(lane = 0; lane < lanes; lane++){
+        for(s = 0; s < group->section_count; s++){
+            sec = &group->sections[s];
+            if(group->engine == FCHIP_ENGINE_TDF2){
+                filters[lane].state[s][0] = sec->s1[lane];
+                filters[lane].state[s][1] = sec->s2[lane];
+                continue;
+            }
+            filters[lane].raw[s][1] = sec->raw2[lane];
+            filters[lane].raw[s][0] = sec->raw1[lane];
+
+            filters[lane].processed[s][1] = sec->processed2[lane];
+            filters[lane].processed[s][0] = sec->processed1[lane];
+        }
+    }
+}
+
+static __always_inline fchip_vfloat_t fchip_filter_section_step_df1(
+    struct fchip_filter_lane_section *sec, 
+    fchip_vfloat_t raw
+)
+{
+    fchip_vfloat_t processed = 
+        sec->b0 * raw 
+      + sec->b1 * sec->raw1
+      + sec->b2 * sec->raw2
+      - sec->a1 * sec->processed1
+      - sec->a2 * sec->processed2
+    ;
+
+    sec->raw2 = sec->raw1;
+    sec->raw1 = raw;
+    sec->processed2 = sec->processed1;
+    sec->processed1 = processed;
+
+    return processed;
+}
+
+// transposed direct form II: two state words, nothing to shift
+static __always_inline fchip_vfloat_t fchip_filter_section_step_tdf2(
+    struct fchip_filter_lane_section *sec, 
+    fchip_vfloat_t raw
+)
+{
+    fchip_vfloat_t processed = sec->b0 * raw + sec->s1;
+
+    sec->s1 = sec->b1 * raw - sec->a1 * processed + sec->s2;
+    sec->s2 = sec->b2 * raw - sec->a2 * processed;
+
+    return processed;
+}
+
+// saturates to [lo, hi]. the converted result of a float out of the 
+// int range is undefined, and an overshoot past full scale (cascades,
+// a high Q, the ringing of a highpass) would wrap around into a click
+static __always_inline fchip_vfloat_t fchip_vfloat_clamp(fchip_vfloat_t x, fchip_vfloat_t lo, fchip_vfloat_t hi)
+{
+    fchip_vint_t below = x < lo;
+    fchip_vint_t above = x > hi;
+    fchip_vint_t bits = (fchip_vint_t)x;
+
+    bits = (bits & ~below) | ((fchip_vint_t)lo & below);
+    bits = (bits & ~above) | ((fchip_vint_t)hi & above);
+    return (fchip_vfloat_t)bits;
+}
+
+// the frame loop of one channel group. section_count and engine are
+// constants at every call site, so the cascade is unrolled and the whole 
+// frame goes through all the sections without leaving the registers
+static __always_inline void fchip_filter_group_run(
+    struct fchip_filter_lane_group *group,
+    const int section_count,
+    const enum fchip_filter_engine engine,
+    int32_t *frame_ptr,
+    int channels,
+    int lanes,
+    unsigned long frames, 
+    int bit_shift, 
+    fchip_vfloat_t to_float,
+    fchip_vfloat_t to_int
+)
+{
+    fchip_vfloat_t sample;
+    fchip_vint_t raw_i, processed_i;
+    // [-1, 1) in steps of the sample: what fits the container, as the 
+    // Q31 engine
+    fchip_vfloat_t lo = {}, hi = {};
+    unsigned long frame;
+    int lane, s;
+
+    lo -= 1.0f;
+    hi += 1.0f;
+    hi -= to_float;
+
+    for(frame = 0; frame < frames; frame++, frame_ptr += channels){
+        if(lanes == FCHIP_FILTER_LANES){
+            memcpy(&raw_i, frame_ptr, sizeof(raw_i));
+        }
+        else{
+            raw_i = (fchip_vint_t){};
+            for(lane = 0; lane < lanes; lane++){
+                raw_i[lane] = frame_ptr[lane];
+            }
+        }
+
+        sample = __builtin_convertvector(raw_i >> bit_shift, fchip_vfloat_t) * to_float;
+
+        for(s = 0; s < section_count; s++){
+            if(engine == FCHIP_ENGINE_TDF2){
+                sample = fchip_filter_section_step_tdf2(&group->sections[s], sample);
+            }
+            else{
+                sample = fchip_filter_section_step_df1(&group->sections[s], sample);
+            }
+        }
+
+        sample = fchip_vfloat_clamp(sample, lo, hi);
+        processed_i = __builtin_convertvector(sample * to_int, fchip_vint_t) << bit_shift;
+
+        if(lanes == FCHIP_FILTER_LANES){
+            memcpy(frame_ptr, &processed_i, sizeof(processed_i));
+        }
+        else{
+            for(lane = 0; lane < lanes; lane++){
+                frame_ptr[lane] = processed_i[lane];
+            }
+        }
+    }
+}
+
+static __always_inline void fchip_filter_group_dispatch(
+    struct fchip_filter_lane_group *group,
+    const enum fchip_filter_engine engine,
+    int32_t *frame_ptr,
+    int channels,
+    int lanes,
+    unsigned long frames, 
+    int bit_shift, 
+    fchip_vfloat_t to_float,
+    fchip_vfloat_t to_int
+)
+{
+    switch(group->section_count){
+        case 1:
+            fchip_filter_group_run(group, 1, engine, frame_ptr, channels, lanes, frames, bit_shift, to_float, to_int);
+            break;
+        case 2:
+            fchip_filter_group_run(group, 2, engine, frame_ptr, channels, lanes, frames, bit_shift, to_float, to_int);
+            break;
+        case 3:
+            fchip_filter_group_run(group, 3, engine, frame_ptr, channels, lanes, frames, bit_shift, to_float, to_int);
+            break;
+        default:
+            fchip_filter_group_run(group, FCHIP_FILTER_MAX_SECTIONS, engine, frame_ptr, channels, lanes, frames, bit_shift, to_float, to_int);
+    }
+}
+
+static void fchip_filter_kernel_process(
+    struct fchip_channel_filter *filters, 
+    int channels,
+    int32_t *data, 
+    unsigned long frames, 
+    int bit_shift, 
+    int sample_max_value
+)
+{
+    struct fchip_filter_lane_group group;
+    fchip_vfloat_t to_float = {};
+    fchip_vfloat_t to_int = {};
+    int32_t *frame_ptr;
+    int base, lanes;
+
+    to_float += 1.0f / sample_max_value;
+    to_int += (fchip_float_t)sample_max_value;
+
+    // channel groups are processed one after another, so that the
+    // coefficients and the history of a group stay in registers
+    // for the whole region
+    for(base = 0; base < channels; base += FCHIP_FILTER_LANES){
+        lanes = min(channels - base, FCHIP_FILTER_LANES);
+        fchip_filter_group_load(&group, &filters[base], lanes);
+
+        frame_ptr = data + base;
+        if(group.engine == FCHIP_ENGINE_TDF2){
+            fchip_filter_group_dispatch(&group, FCHIP_ENGINE_TDF2, frame_ptr, channels, lanes, frames, bit_shift, to_float, to_int);
+        }
+        else{
+            fchip_filter_group_dispatch(&group, FCHIP_ENGINE_DF1, frame_ptr, channels, lanes, frames, bit_shift, to_float, to_int);
+        }
+
+        fchip_filter_group_store(&group, &filters[base], lanes);
+    }
+}
+
+const struct fchip_filter_kernel FCHIP_FILTER_KERNEL = {
+    .name = __stringify(FCHIP_FILTER_KERNEL),
+    .lanes = FCHIP_FILTER_LANES,
+    .process_interleaved = fchip_filter_kernel_process,
+};
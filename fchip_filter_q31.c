@@ -0,0 +1,110 @@
+// fixed point biquad engine (FCHIP_ENGINE_Q31). there is no floating
+// point in here: this object is built with the normal kernel flags, 
+// so it can run in atomic context without a kernel_fpu_begin section.
+// the coefficients are converted from fchip_conv_table when the filter 
+// coefficients are computed, see fchip_calculate_convolution_table
+#include <linux/kernel.h>
+#include <linux/limits.h>
+#include <linux/minmax.h>
+#include "fchip_filter.h"
+
+// a Q31 x Q31 product is Q62. the products are shifted right by the 
+// guard bits before they are summed, so that five of them can't 
+// overflow the 64 bit accumulator even for full scale input
+#define FCHIP_Q31_GUARD_BITS 2
+#define FCHIP_Q31_ACC_SHIFT (31 - FCHIP_Q31_POSTSHIFT - FCHIP_Q31_GUARD_BITS)
+
+static inline s32 fchip_q31_requantize(s64 acc, int shift, enum fchip_filter_rounding rounding, s64 *error)
+{
+    switch(rounding){
+        case FCHIP_ROUNDING_NEAREST:
+            acc += (s64)1 << (shift - 1);
+            break;
+        case FCHIP_ROUNDING_ERROR_FEEDBACK:
+            acc += *error;
+            *error = acc & (((s64)1 << shift) - 1);
+            break;
+        // case FCHIP_ROUNDING_TRUNCATE:
+        default:
+            break;
+    }
+
+    return clamp_t(s64, acc >> shift, S32_MIN, S32_MAX);
+}
+
+static inline s32 fchip_q31_section(
+    struct fchip_conv_table_q31 *c,
+    s32 *raw,
+    s32 *processed,
+    s64 *error,
+    enum fchip_filter_rounding rounding,
+    s32 sample
+)
+{
+    s64 acc;
+    s32 out;
+
+    acc = ((s64)c->b0 * sample >> FCHIP_Q31_GUARD_BITS)
+        + ((s64)c->b1 * raw[0] >> FCHIP_Q31_GUARD_BITS)
+        + ((s64)c->b2 * raw[1] >> FCHIP_Q31_GUARD_BITS)
+        - ((s64)c->a1 * processed[0] >> FCHIP_Q31_GUARD_BITS)
+        - ((s64)c->a2 * processed[1] >> FCHIP_Q31_GUARD_BITS);
+
+    out = fchip_q31_requantize(acc, FCHIP_Q31_ACC_SHIFT, rounding, error);
+
+    raw[1] = raw[0];
+    raw[0] = sample;
+    processed[1] = processed[0];
+    processed[0] = out;
+
+    return out;
+}
+
+s32 fchip_filter_process_q31(struct fchip_channel_filter *filter, s32 sample)
+{
+    for(int s = 0; s < filter->active_sections; s++){
+        sample = fchip_q31_section(&filter->coeffs->table_q31[s], filter->raw_q31[s], 
+            filter->processed_q31[s], &filter->error_q31[s], filter->rounding, sample);
+    }
+    return sample;
+}
+
+// back to the bit depth of the stream: the unused low bits must be zero
+static inline s32 fchip_q31_to_sample(s32 sample, int bit_shift, enum fchip_filter_rounding rounding)
+{
+    s64 rounded = sample;
+
+    if(!bit_shift){
+        return sample;
+    }
+    if(rounding != FCHIP_ROUNDING_TRUNCATE){
+        rounded += 1 << (bit_shift - 1);
+        rounded = min_t(s64, rounded, S32_MAX);
+    }
+    return (s32)rounded & ~((1 << bit_shift) - 1);
+}
+
+void fchip_filter_process_interleaved_q31(
+    struct fchip_channel_filter *filters, 
+    int channels,
+    int32_t *data, 
+    unsigned long frames, 
+    int bit_shift
+)
+{
+    struct fchip_channel_filter *filter;
+    int32_t *sample_ptr;
+    unsigned long frame;
+    int ch;
+
+    // the samples are MSB-justified in their 32 bit containers, 
+    // which makes them Q31 numbers already: no conversion needed
+    for(ch = 0; ch < channels; ch++){
+        filter = &filters[ch];
+        sample_ptr = data + ch;
+        for(frame = 0; frame < frames; frame++, sample_ptr += channels){
+            *sample_ptr = fchip_q31_to_sample(fchip_filter_process_q31(filter, *sample_ptr), 
+                bit_shift, filter->rounding);
+        }
+    }
+}
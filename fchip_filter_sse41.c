@@ -0,0 +1,5 @@
+// SSE4.1 kernel: 4 channels per xmm register
+#define FCHIP_FILTER_LANES 4
+#define FCHIP_FILTER_KERNEL fchip_filter_kernel_sse41
+
+#include "fchip_filter_kernel_template.h"
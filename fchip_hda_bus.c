@@ -62,6 +62,101 @@ static int fchip_single_send_cmd(struct hdac_bus *bus, u32 val)
 	return -EIO;
 }
 
+// batched verbs (cmd_batch=1): the verbs go into the CORB without 
+// waiting for each response, and CORBWP is written once per 
+// FCHIP_CORB_BATCH verbs and at the end of the list, instead of 
+// once per verb. only for explicit verb lists (fchip_bus_queue_verbs):
+// the core's own verbs keep sync_write and go one at a time
+#define FCHIP_CORB_ENTRIES	256
+#define FCHIP_CORB_BATCH	64
+
+static int fchip_rirb_get_response(struct hdac_bus *bus, unsigned int addr,
+				 unsigned int *res);
+
+// under reg_lock
+static void fchip_corb_ring(struct fchip_azx *fchip_azx)
+{
+	if (fchip_azx->corb_pending) {
+		snd_hdac_chip_writew(azx_to_hda_bus(fchip_azx), CORBWP, fchip_azx->corb_wp);
+		fchip_azx->corb_pending = 0;
+	}
+}
+
+// -EAGAIN if the CORB is full; what's queued is rung then
+static int fchip_batch_queue_cmd(struct hdac_bus *bus, u32 val)
+{
+	struct fchip_azx* fchip_azx = hdac_bus_to_azx(bus);
+	unsigned int addr = fchip_command_addr(val);
+	unsigned int wp;
+	int err = 0;
+
+	spin_lock_irq(&bus->reg_lock);
+	bus->last_cmd[addr] = val;
+	// everything so far was rung: start from the hardware, which also
+	// covers a bus reset (fchip_rirb_get_response) setting CORBWP back
+	if (!fchip_azx->corb_pending) {
+		wp = snd_hdac_chip_readw(bus, CORBWP);
+		if (wp == 0xffff) {
+			err = -EIO;
+			goto unlock;
+		}
+		fchip_azx->corb_wp = wp % FCHIP_CORB_ENTRIES;
+		fchip_azx->corb_rp = snd_hdac_chip_readw(bus, CORBRP);
+	}
+	wp = (fchip_azx->corb_wp + 1) % FCHIP_CORB_ENTRIES;
+	if (wp == fchip_azx->corb_rp) {
+		fchip_azx->corb_rp = snd_hdac_chip_readw(bus, CORBRP);
+		if (fchip_azx->corb_rp == 0xffff) {
+			err = -EIO;
+			goto unlock;
+		}
+	}
+	if (wp == fchip_azx->corb_rp) {
+		fchip_corb_ring(fchip_azx);
+		err = -EAGAIN;
+		goto unlock;
+	}
+
+	bus->rirb.cmds[addr]++;
+	bus->corb.buf[wp] = cpu_to_le32(val);
+	fchip_azx->corb_wp = wp;
+	if (++fchip_azx->corb_pending >= FCHIP_CORB_BATCH){
+		fchip_corb_ring(fchip_azx);
+	}
+
+ unlock:
+	spin_unlock_irq(&bus->reg_lock);
+	return err;
+}
+
+// under cmd_mutex
+static int fchip_batch_send_cmd(struct hdac_bus *bus, u32 val)
+{
+	unsigned int addr;
+	int err;
+
+	for (;;) {
+		err = fchip_batch_queue_cmd(bus, val);
+		if (err != -EAGAIN){
+			return err;
+		}
+		// the CORB is full of verbs of any codec, not necessarily 
+		// the one `val` goes to: wait for one that has some in flight,
+		// its responses free their entries
+		for (addr = 0; addr < FCHIP_AZX_MAX_CODECS; addr++) {
+			if (bus->rirb.cmds[addr]){
+				break;
+			}
+		}
+		if (addr < FCHIP_AZX_MAX_CODECS) {
+			err = fchip_rirb_get_response(bus, addr, NULL);
+			if (err < 0){
+				return err;
+			}
+		}
+	}
+}
+
 int fchip_send_cmd(struct hdac_bus *bus, unsigned int val)
 {
 	struct fchip_azx *fchip_azx = hdac_bus_to_azx(bus);
@@ -169,6 +264,38 @@ int fchip_get_response(struct hdac_bus *bus, unsigned int addr, unsigned int *re
     }
 }
 
+static bool fchip_bus_can_batch(struct fchip_azx *fchip_azx)
+{
+	struct hdac_bus *bus = azx_to_hda_bus(fchip_azx);
+
+	return fchip_azx->cmd_batch && !fchip_azx->single_cmd && !bus->use_pio_for_commands;
+}
+
+// sends `count` verbs, without waiting for any response in between: 
+// with cmd_batch, CORBWP is written once for all of them. the responses
+// are then taken with fchip_get_response, the last one of each codec 
+// address is kept. under cmd_mutex. returns how many verbs were sent
+int fchip_bus_queue_verbs(struct fchip_azx *fchip_azx, const unsigned int *verbs, int count)
+{
+	struct hdac_bus *bus = azx_to_hda_bus(fchip_azx);
+	int i, err = 0;
+
+	for (i = 0; i < count && !err; i++) {
+		if (fchip_bus_can_batch(fchip_azx)){
+			err = fchip_batch_send_cmd(bus, verbs[i]);
+		}
+		else{
+			err = fchip_send_cmd(bus, verbs[i]);
+		}
+	}
+	if (fchip_bus_can_batch(fchip_azx)) {
+		spin_lock_irq(&bus->reg_lock);
+		fchip_corb_ring(fchip_azx);
+		spin_unlock_irq(&bus->reg_lock);
+	}
+	return err ? i - 1 : i;
+}
+
 static const struct hdac_bus_ops bus_core_ops = {
 	.command = fchip_send_cmd,
 	.get_response = fchip_get_response,
@@ -192,8 +319,8 @@ int fchip_bus_init(struct fchip_azx* fchip_azx, const char* model)
 	bus->modelname = model;
 	bus->mixer_assigned = -1;
 	bus->core.snoop = fchip_snoop(fchip_azx);
-	if (fchip_azx->get_position[0] != fchip_get_pos_lpib ||
-	    fchip_azx->get_position[1] != fchip_get_pos_lpib)
+	if (fchip_azx->pos_method[0] != FCHIP_POS_LPIB ||
+	    fchip_azx->pos_method[1] != FCHIP_POS_LPIB)
     {
 		bus->core.use_posbuf = true;
     }
@@ -5,4 +5,5 @@
 
 int fchip_bus_init(struct fchip_azx* fchip_azx, const char* model);
 int fchip_send_cmd(struct hdac_bus *bus, unsigned int val);
-int fchip_get_response(struct hdac_bus *bus, unsigned int addr, unsigned int *res);
\ No newline at end of file
+int fchip_get_response(struct hdac_bus *bus, unsigned int addr, unsigned int *res);
+int fchip_bus_queue_verbs(struct fchip_azx *fchip_azx, const unsigned int *verbs, int count);
\ No newline at end of file
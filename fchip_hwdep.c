@@ -0,0 +1,116 @@
+#include <linux/vmalloc.h>
+#include <linux/mm.h>
+#include <linux/uaccess.h>
+#include <sound/hwdep.h>
+#include "fchip_hwdep.h"
+
+static int fchip_hwdep_slot_index(u32 device, u32 stream)
+{
+	if (device >= FCHIP_HWDEP_DEVICES || stream > SNDRV_PCM_STREAM_LAST) {
+		return -EINVAL;
+	}
+	return device * 2 + stream;
+}
+
+static long fchip_hwdep_write(struct snd_hwdep *hw, const char __user *buf,
+			      long count, loff_t *offset)
+{
+	struct fchip_hwdep *fhw = hw->private_data;
+	struct fchip_hwdep_record record;
+	struct fchip_filter_user_slot *slot;
+	long done;
+	int idx;
+	u32 seq;
+
+	if (count % sizeof(record)) {
+		return -EINVAL;
+	}
+
+	for (done = 0; done < count; done += sizeof(record)) {
+		if (copy_from_user(&record, buf + done, sizeof(record))) {
+			return done ? done : -EFAULT;
+		}
+		idx = fchip_hwdep_slot_index(record.device, record.stream);
+		if (idx < 0 || record.set.sections > FCHIP_FILTER_MAX_SECTIONS) {
+			return done ? done : -EINVAL;
+		}
+
+		// the same protocol userspace follows on the mmapped page
+		mutex_lock(&fhw->write_lock);
+		slot = &fhw->page->slots[idx];
+		seq = READ_ONCE(slot->seq);
+		slot->set[(seq + 1) & 1] = record.set;
+		smp_store_release(&slot->seq, seq + 1);
+		mutex_unlock(&fhw->write_lock);
+	}
+	return done;
+}
+
+static int fchip_hwdep_mmap(struct snd_hwdep *hw, struct file *file,
+			    struct vm_area_struct *vma)
+{
+	struct fchip_hwdep *fhw = hw->private_data;
+
+	if (vma->vm_pgoff ||
+	    vma->vm_end - vma->vm_start > PAGE_ALIGN(sizeof(*fhw->page))) {
+		return -EINVAL;
+	}
+	return remap_vmalloc_range(vma, fhw->page, 0);
+}
+
+static void fchip_hwdep_free(struct snd_hwdep *hw)
+{
+	struct fchip_hwdep *fhw = hw->private_data;
+
+	vfree(fhw->page);
+	kfree(fhw);
+}
+
+// one per card; the PCMs of the card take their slot at open
+int fchip_hwdep_new(struct fchip_azx *chip)
+{
+	struct fchip_hwdep *fhw;
+	struct snd_hwdep *hw;
+	int err;
+
+	fhw = kzalloc(sizeof(*fhw), GFP_KERNEL);
+	if (!fhw) {
+		return -ENOMEM;
+	}
+	fhw->page = vmalloc_user(PAGE_ALIGN(sizeof(*fhw->page)));
+	if (!fhw->page) {
+		kfree(fhw);
+		return -ENOMEM;
+	}
+	mutex_init(&fhw->write_lock);
+
+	err = snd_hwdep_new(chip->card, "FilterChip DSP", 0, &hw);
+	if (err < 0) {
+		vfree(fhw->page);
+		kfree(fhw);
+		return err;
+	}
+	strscpy(hw->name, "FilterChip coefficients", sizeof(hw->name));
+	hw->private_data = fhw;
+	hw->private_free = fchip_hwdep_free;
+	hw->ops.write = fchip_hwdep_write;
+	hw->ops.mmap = fchip_hwdep_mmap;
+
+	fhw->hwdep = hw;
+	chip->hwdep = fhw;
+	return 0;
+}
+
+struct fchip_filter_user_slot *fchip_hwdep_slot(struct fchip_azx *chip, struct snd_pcm_substream *substream)
+{
+	int idx;
+
+	if (!chip->hwdep) {
+		return NULL;
+	}
+	idx = fchip_hwdep_slot_index(substream->pcm->device, substream->stream);
+	if (idx < 0) {
+		return NULL;
+	}
+	return &chip->hwdep->page->slots[idx];
+}
\ No newline at end of file
@@ -0,0 +1,39 @@
+#pragma once
+#include "fchip.h"
+#include "fchip_filter.h"
+#include <sound/pcm.h>
+// this module is responsible for the hwdep device that takes 
+// coefficient sets designed in userspace, so that an update 
+// costs a copy instead of fchip_calculate_convolution_table.
+// there are two ways in, both ending in the same slot:
+//  - write() of any number of struct fchip_hwdep_record
+//  - mmap() of struct fchip_hwdep_page, filled in place following
+//    the protocol of struct fchip_filter_user_slot
+// the streams pick new sets up at the start of their next block
+
+// PCM devices that get a slot
+#define FCHIP_HWDEP_DEVICES 16
+#define FCHIP_HWDEP_SLOTS (FCHIP_HWDEP_DEVICES * 2)
+
+struct fchip_hwdep_record
+{
+	u32 device;	// PCM device
+	u32 stream;	// SNDRV_PCM_STREAM_*
+	struct fchip_filter_user_set set;
+};
+
+struct fchip_hwdep_page
+{
+	// device * 2 + stream
+	struct fchip_filter_user_slot slots[FCHIP_HWDEP_SLOTS];
+};
+
+struct fchip_hwdep
+{
+	struct snd_hwdep *hwdep;
+	struct fchip_hwdep_page *page;	// vmalloc_user'd, mmapped as is
+	struct mutex write_lock;	// serializes write()
+};
+
+int fchip_hwdep_new(struct fchip_azx *chip);
+struct fchip_filter_user_slot *fchip_hwdep_slot(struct fchip_azx *chip, struct snd_pcm_substream *substream);
\ No newline at end of file
@@ -1,19 +1,81 @@
 #include "fchip_int.h"
 #include "fchip_hda_bus.h"
 #include "fchip_posfix.h"
+#include "fchip_pcm.h"
+
+// see fchip_quirk_ctx_workaround and friends in fchip.h
+DEFINE_STATIC_KEY_FALSE(fchip_ctx_workaround_key);
+DEFINE_STATIC_KEY_FALSE(fchip_loongson_key);
+
+// at the end of fchip_create; the put in fchip_free, after free_irq
+void fchip_quirk_keys_get(struct fchip_azx *fchip_azx)
+{
+	if (fchip_azx->driver_caps & AZX_DCAPS_CTX_WORKAROUND){
+		static_branch_inc(&fchip_ctx_workaround_key);
+		fchip_azx->quirk_keys |= FCHIP_QUIRK_CTX_WORKAROUND;
+	}
+	if (fchip_azx->driver_type == AZX_DRIVER_LOONGSON){
+		static_branch_inc(&fchip_loongson_key);
+		fchip_azx->quirk_keys |= FCHIP_QUIRK_LOONGSON;
+	}
+}
+
+void fchip_quirk_keys_put(struct fchip_azx *fchip_azx)
+{
+	if (fchip_azx->quirk_keys & FCHIP_QUIRK_CTX_WORKAROUND){
+		static_branch_dec(&fchip_ctx_workaround_key);
+	}
+	if (fchip_azx->quirk_keys & FCHIP_QUIRK_LOONGSON){
+		static_branch_dec(&fchip_loongson_key);
+	}
+	fchip_azx->quirk_keys = 0;
+}
 
 static void stream_update(struct hdac_bus *bus, struct hdac_stream *s)
 {
 	struct fchip_azx* fchip_azx = hdac_bus_to_azx(bus);
 	struct azx_dev *azx_dev = hdac_stream_to_azx_dev(s);
 
-	// check whether this IRQ is really acceptable
+	// check whether this IRQ is really acceptable; the notification 
+	// itself waits until fchip_interrupt drops reg_lock
 	if (!fchip_azx->ops->position_check ||
 	    fchip_azx->ops->position_check(fchip_azx, azx_dev)) 
-    {
-		spin_unlock(&bus->reg_lock);
-		snd_pcm_period_elapsed(azx_dev_to_hdac_stream(azx_dev)->substream);
-		spin_lock(&bus->reg_lock);
+	{
+		__set_bit(s->index, &fchip_azx->irq_elapsed);
+	}
+}
+
+// calls snd_pcm_period_elapsed for the streams in `streams`, without
+// reg_lock: one lock round trip per interrupt instead of one per stream
+static void fchip_notify_elapsed(struct fchip_azx *fchip_azx, unsigned long streams)
+{
+	struct hdac_bus *bus = azx_to_hda_bus(fchip_azx);
+	struct hdac_stream *s;
+	struct snd_pcm_substream *substream;
+
+	list_for_each_entry(s, &bus->stream_list, list) {
+		if (!(streams & BIT(s->index))){
+			continue;
+		}
+		substream = READ_ONCE(s->substream);
+		if (substream){
+			fchip_pcm_period_elapsed(substream);
+			atomic64_inc(&fchip_azx->irq_stats.elapsed);
+		}
+	}
+}
+
+// under reg_lock; read through debugfs (fchip_debugfs.c)
+static void fchip_irq_account(struct fchip_azx *fchip_azx, int loops, bool limited)
+{
+	struct fchip_irq_stats *stats = &fchip_azx->irq_stats;
+
+	stats->irqs++;
+	stats->loops += loops;
+	stats->repeats += loops - 1;
+	stats->max_loops = max_t(u32, stats->max_loops, loops);
+	if (limited){
+		stats->limit_hits++;
 	}
 }
 
@@ -24,6 +86,8 @@ static irqreturn_t fchip_interrupt(int irq, void *dev_id)
 	u32 status;
 	bool active, handled = false;
 	int repeat = 0; /* count for avoiding endless loop */
+	int loops = 0;
+	unsigned long elapsed;
 
 	if (fchip_has_pm_runtime(fchip_azx)){
 		if (!pm_runtime_active(fchip_azx->card->dev)){
@@ -38,6 +102,7 @@ static irqreturn_t fchip_interrupt(int irq, void *dev_id)
     }
 
 	do {
+		loops++;
 		status = fchip_readreg_l(fchip_azx, INTSTS);
 		if (status == 0 || status == 0xffffffff){
 			break;
@@ -60,7 +125,7 @@ static irqreturn_t fchip_interrupt(int irq, void *dev_id)
 			fchip_writereg_b(fchip_azx, RIRBSTS, RIRB_INT_MASK);
 			active = true;
 			if (status & RIRB_INT_RESPONSE) {
-				if (fchip_azx->driver_caps & AZX_DCAPS_CTX_WORKAROUND){
+				if (fchip_quirk_ctx_workaround(fchip_azx)){
 					udelay(80);
                 }
 				snd_hdac_bus_update_rirb(bus);
@@ -68,68 +133,242 @@ static irqreturn_t fchip_interrupt(int irq, void *dev_id)
 		}
 	} while (active && ++repeat < 10);
 
+	if (handled){
+		fchip_irq_account(fchip_azx, loops, repeat >= 10);
+	}
+
  unlock:
+	elapsed = fchip_azx->irq_elapsed;
+	fchip_azx->irq_elapsed = 0;
 	spin_unlock(&bus->reg_lock);
 
+	if (elapsed){
+		fchip_notify_elapsed(fchip_azx, elapsed);
+	}
+
 	return IRQ_RETVAL(handled);
 }
 
-void fchip_irq_pending_work(struct work_struct *work)
+// threaded mode (threaded_irq=1). the hard half only reads and acks 
+// the status registers and latches what it found; the position checks,
+// the RIRB update (and its udelay) and snd_pcm_period_elapsed, with 
+// the filtering behind it, run in the IRQ thread
+static void stream_latch(struct hdac_bus *bus, struct hdac_stream *s)
 {
-	struct fchip_hda_intel* hda = container_of(work, struct fchip_hda_intel, irq_pending_work);
-	struct fchip_azx* fchip_azx = &hda->chip;
-	struct hdac_bus *bus = azx_to_hda_bus(fchip_azx);
-	struct hdac_stream *s;
-	int pending, ok;
+	struct fchip_azx* fchip_azx = hdac_bus_to_azx(bus);
 
-	if (!hda->irq_pending_warned) {
-		printk(KERN_INFO "fchip: IRQ timing workaround is activated for card #%d. Suggest a bigger bdl_pos_adj.\n",
-			 fchip_azx->card->number);
-		hda->irq_pending_warned = 1;
+	set_bit(s->index, &fchip_azx->irq_streams);
+}
+
+static irqreturn_t fchip_interrupt_hard(int irq, void *dev_id)
+{
+	struct fchip_azx* fchip_azx = dev_id;
+	struct hdac_bus* bus = azx_to_hda_bus(fchip_azx);
+	u32 status;
+	bool active, handled = false, wake = false;
+	int repeat = 0; /* count for avoiding endless loop */
+	int loops = 0;
+
+	if (fchip_has_pm_runtime(fchip_azx)){
+		if (!pm_runtime_active(fchip_azx->card->dev)){
+			return IRQ_NONE;
+		}
 	}
 
-	for (;;) {
-		pending = 0;
-		spin_lock_irq(&bus->reg_lock);
+	spin_lock(&bus->reg_lock);
 
-		list_for_each_entry(s, &bus->stream_list, list) {
-			struct azx_dev *azx_dev = hdac_stream_to_azx_dev(s);
-			if (!azx_dev->irq_pending || !s->substream || !s->running)
-			{
-				continue;
-			}
+	if (fchip_azx->disabled){
+		goto unlock;
+	}
 
-			ok = fchip_position_ok(fchip_azx, azx_dev);
-			if (ok > 0) {
-				azx_dev->irq_pending = 0;
-				spin_unlock(&bus->reg_lock);
-				snd_pcm_period_elapsed(s->substream);
-				spin_lock(&bus->reg_lock);
-			} 
-			else if (ok < 0) {
-				pending = 0;	/* too early */
-			} 
-			else{
-				pending++;
+	do {
+		loops++;
+		status = fchip_readreg_l(fchip_azx, INTSTS);
+		if (status == 0 || status == 0xffffffff){
+			break;
+		}
+
+		handled = true;
+		active = false;
+		// reads and clears SD_STS, stream_latch only sets a bit
+		if (snd_hdac_bus_handle_stream_irq(bus, status, stream_latch)){
+			active = true;
+			wake = true;
+		}
+
+		status = fchip_readreg_b(fchip_azx, RIRBSTS);
+		if (status & RIRB_INT_MASK) {
+			// acked before the thread reads the RIRB wp, see fchip_interrupt
+			fchip_writereg_b(fchip_azx, RIRBSTS, RIRB_INT_MASK);
+			active = true;
+			if (status & RIRB_INT_RESPONSE) {
+				set_bit(0, &fchip_azx->irq_rirb);
+				wake = true;
 			}
 		}
-		
+	} while (active && ++repeat < 10);
+
+	if (handled){
+		fchip_irq_account(fchip_azx, loops, repeat >= 10);
+	}
+
+ unlock:
+	spin_unlock(&bus->reg_lock);
+
+	if (wake){
+		return IRQ_WAKE_THREAD;
+	}
+	return IRQ_RETVAL(handled);
+}
+
+static irqreturn_t fchip_interrupt_thread(int irq, void *dev_id)
+{
+	struct fchip_azx* fchip_azx = dev_id;
+	struct hdac_bus* bus = azx_to_hda_bus(fchip_azx);
+	struct hdac_stream *s;
+	unsigned long streams;
+	bool ok;
+
+	if (test_and_clear_bit(0, &fchip_azx->irq_rirb)) {
+		spin_lock_irq(&bus->reg_lock);
+		if (fchip_quirk_ctx_workaround(fchip_azx)){
+			udelay(80);
+		}
+		snd_hdac_bus_update_rirb(bus);
 		spin_unlock_irq(&bus->reg_lock);
-		if (!pending){
-			return;
+	}
+
+	streams = xchg(&fchip_azx->irq_streams, 0);
+	list_for_each_entry(s, &bus->stream_list, list) {
+		if (!(streams & BIT(s->index))){
+			continue;
 		}
 
-		msleep(1);
+		// the stream may have been stopped since the hard half ran
+		spin_lock_irq(&bus->reg_lock);
+		ok = s->substream && s->running &&
+			(!fchip_azx->ops->position_check ||
+			 fchip_azx->ops->position_check(fchip_azx, hdac_stream_to_azx_dev(s)));
+		spin_unlock_irq(&bus->reg_lock);
+
+		if (ok){
+			fchip_pcm_period_elapsed(s->substream);
+			atomic64_inc(&fchip_azx->irq_stats.elapsed);
+		}
+	}
+
+	return IRQ_HANDLED;
+}
+
+// an interrupt came before the position crossed the period boundary
+// (or the position lags, see bdl_pos_adj): the stream's timer checks 
+// again at the moment the wallclock predicts the crossing, then in 
+// steps of bdl_pos_adj frames; hrtimers, as a sleep would take ticks
+#define FCHIP_IRQ_PENDING_MIN_NS	(50 * NSEC_PER_USEC)
+
+static u64 fchip_irq_pending_delay(struct fchip_azx *fchip_azx, struct azx_dev *azx_dev)
+{
+	struct hdac_stream *s = azx_dev_to_hdac_stream(azx_dev);
+	struct snd_pcm_runtime *runtime = s->substream->runtime;
+	s32 left;
+	u64 step = FCHIP_IRQ_PENDING_MIN_NS;
+
+	// the boundary is due one period after the last accepted one
+	left = s->start_wallclk + s->period_wallclk - fchip_readreg_l(fchip_azx, WALLCLK);
+	if (left > 0){
+		return max_t(u64, FCHIP_WALLCLK_TO_NS(left), FCHIP_IRQ_PENDING_MIN_NS);
+	}
+
+	if (runtime->rate && fchip_azx->bdl_pos_adj > 0){
+		step = max_t(u64, step, div_u64((u64)fchip_azx->bdl_pos_adj * NSEC_PER_SEC, runtime->rate));
+	}
+	return step;
+}
+
+static enum hrtimer_restart fchip_irq_pending_timer(struct hrtimer *timer)
+{
+	struct azx_dev *azx_dev = container_of(timer, struct azx_dev, irq_timer);
+	struct fchip_azx *fchip_azx = azx_dev->chip;
+	struct hdac_bus *bus = azx_to_hda_bus(fchip_azx);
+	struct hdac_stream *s = azx_dev_to_hdac_stream(azx_dev);
+	struct snd_pcm_substream *substream = NULL;
+	unsigned long flags;
+	int ok;
+
+	spin_lock_irqsave(&bus->reg_lock, flags);
+	if (!azx_dev->irq_pending || !s->substream || !s->running){
+		goto unlock;
+	}
+
+	ok = fchip_position_ok(fchip_azx, azx_dev);
+	if (ok > 0) {
+		azx_dev->irq_pending = 0;
+		WRITE_ONCE(azx_dev->estimator.resync, true);
+		substream = s->substream;
+	}
+	else if (ok == 0) {
+		hrtimer_forward_now(timer, ns_to_ktime(fchip_irq_pending_delay(fchip_azx, azx_dev)));
+		spin_unlock_irqrestore(&bus->reg_lock, flags);
+		return HRTIMER_RESTART;
+	}
+	// ok < 0: too early after all, the next interrupt handles it
+
+ unlock:
+	spin_unlock_irqrestore(&bus->reg_lock, flags);
+	if (substream){
+		fchip_pcm_period_elapsed(substream);
 	}
+	return HRTIMER_NORESTART;
+}
+
+// threaded mode (threaded_irq=1) keeps the period notification out of
+// hardirq context, the late one included: the timer expires in softirq
+// context then
+static enum hrtimer_mode fchip_irq_pending_mode(struct fchip_azx *fchip_azx)
+{
+	return fchip_azx->threaded_irq ? HRTIMER_MODE_REL_SOFT : HRTIMER_MODE_REL;
+}
+
+void fchip_irq_pending_init(struct fchip_azx *fchip_azx, struct azx_dev *azx_dev)
+{
+	azx_dev->chip = fchip_azx;
+	hrtimer_setup(&azx_dev->irq_timer, fchip_irq_pending_timer, CLOCK_MONOTONIC, 
+		fchip_irq_pending_mode(fchip_azx));
+}
+
+// under reg_lock, from the position check of the interrupt handler
+void fchip_irq_pending_arm(struct fchip_azx *fchip_azx, struct azx_dev *azx_dev)
+{
+	struct fchip_hda_intel *hda = container_of(fchip_azx, struct fchip_hda_intel, chip);
+
+	if (!hda->irq_pending_warned) {
+		printk(KERN_INFO "fchip: IRQ timing workaround is activated for card #%d. Suggest a bigger bdl_pos_adj.\n",
+			 fchip_azx->card->number);
+		hda->irq_pending_warned = 1;
+	}
+
+	hrtimer_start(&azx_dev->irq_timer, ns_to_ktime(fchip_irq_pending_delay(fchip_azx, azx_dev)), 
+		fchip_irq_pending_mode(fchip_azx));
 }
 
 int fchip_acquire_irq(struct fchip_azx *fchip_azx, int do_disconnect)
 {
 	struct hdac_bus *bus = azx_to_hda_bus(fchip_azx);
+	int err;
 
-	if (request_irq(fchip_azx->pci->irq, fchip_interrupt,
-			fchip_azx->msi ? 0 : IRQF_SHARED,
-			fchip_azx->card->irq_descr, fchip_azx)) 
+	// the hard half acks the controller itself, so no IRQF_ONESHOT 
+	// is needed and the line stays shareable
+	if (fchip_azx->threaded_irq){
+		err = request_threaded_irq(fchip_azx->pci->irq, fchip_interrupt_hard,
+				fchip_interrupt_thread, fchip_azx->msi ? 0 : IRQF_SHARED,
+				fchip_azx->card->irq_descr, fchip_azx);
+	}
+	else{
+		err = request_irq(fchip_azx->pci->irq, fchip_interrupt,
+				fchip_azx->msi ? 0 : IRQF_SHARED,
+				fchip_azx->card->irq_descr, fchip_azx);
+	}
+	if (err) 
 	{
 		printk(KERN_ERR "fchip: Unable to grab IRQ %d, disabling device\n", fchip_azx->pci->irq);
 
@@ -144,7 +383,7 @@ int fchip_acquire_irq(struct fchip_azx *fchip_azx, int do_disconnect)
 	return 0;
 }
 
-/* clear irq_pending flags and assure no on-going workq */
+/* clear irq_pending flags and assure no on-going timer */
 void fchip_clear_irq_pending(struct fchip_azx* fchip_azx)
 {
 	struct hdac_bus *bus = azx_to_hda_bus(fchip_azx);
@@ -156,6 +395,11 @@ void fchip_clear_irq_pending(struct fchip_azx* fchip_azx)
 		azx_dev->irq_pending = 0;
 	}
 	spin_unlock_irq(&bus->reg_lock);
+
+	// outside reg_lock: a running callback takes it
+	list_for_each_entry(s, &bus->stream_list, list) {
+		hrtimer_cancel(&hdac_stream_to_azx_dev(s)->irq_timer);
+	}
 }
 
 int fchip_disable_msi_reset_irq(struct fchip_azx* fchip_azx)
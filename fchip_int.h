@@ -7,5 +7,8 @@
 
 int fchip_acquire_irq(struct fchip_azx *fchip_azx, int do_disconnect);
 void fchip_clear_irq_pending(struct fchip_azx* fchip_azx);
+void fchip_quirk_keys_get(struct fchip_azx *fchip_azx);
+void fchip_quirk_keys_put(struct fchip_azx *fchip_azx);
 int fchip_disable_msi_reset_irq(struct fchip_azx *chip);
-void fchip_irq_pending_work(struct work_struct *work);
\ No newline at end of file
+void fchip_irq_pending_init(struct fchip_azx *fchip_azx, struct azx_dev *azx_dev);
+void fchip_irq_pending_arm(struct fchip_azx *fchip_azx, struct azx_dev *azx_dev);
\ No newline at end of file
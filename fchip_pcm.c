@@ -1,24 +1,402 @@
+#include <linux/string.h>
+#include <linux/uio.h>
+#include <linux/vmalloc.h>
+#include <linux/kthread.h>
+#include <linux/sched.h>
+#include <uapi/linux/sched/types.h>
+#include <sound/control.h>
 #include "fchip_pcm.h"
 #include "fchip_posfix.h"
+#include "fchip_hwdep.h"
 #include "fchip.h"
 
 // welp, only int. what a bummer.
 static int filter_type = FCHIP_FILTER_NONE;
 static int filter_cutoff_freq = 1000;
+static int filter_q = FCHIP_FILTER_Q_DEFAULT;
+static int filter_sections = 1;
+static int filter_engine = FCHIP_ENGINE_DF1;
+static int filter_rounding = FCHIP_ROUNDING_NEAREST;
+
+// optional filter thread per stream, see fchip_filter_worker
+static bool filter_worker;
+static int filter_worker_prio = 50;
+static int filter_worker_cpu = -1;
+static int filter_worker_margin_us = 2000;
+
+// pointer position estimation, see fchip_pcm_estimate_position
+static unsigned int position_estimate_us;
+
+// crosstimestamp interpolation, see fchip_get_crosststamp_cached
+static unsigned int tstamp_cache_ms;
+static unsigned int tstamp_cache_max_err_ns = 1000;
+
+// the module params above are the defaults of the mixer controls,
+// in the order of enum fchip_filter_setting
+static int *const fchip_filter_param_vars[FCHIP_FILTER_SETTING_COUNT] = {
+	&filter_type, &filter_cutoff_freq, &filter_q, &filter_sections,
+};
+
+// the open streams (for the live parameter updates) and the mixer 
+// control settings; both under fchip_live_streams_lock
+static LIST_HEAD(fchip_live_streams);
+static LIST_HEAD(fchip_filter_ctls);
+static DEFINE_MUTEX(fchip_live_streams_lock);
+
+static void fchip_filter_ctl_values(struct fchip_filter_ctl *ctl, int *values){
+	for(int i = 0; i < FCHIP_FILTER_SETTING_COUNT; i++){
+		values[i] = ctl ? ctl->values[i] : *fchip_filter_param_vars[i];
+	}
+}
+
+// pushes the settings of `ctl` (NULL: the module params) to the
+// running streams using them; no allocation unless the coefficient
+// cache is exhausted
+static void fchip_filter_ctl_apply(struct fchip_filter_ctl *ctl){
+	struct fchip_runtime_pr *runtime_pr;
+	int values[FCHIP_FILTER_SETTING_COUNT];
+
+	lockdep_assert_held(&fchip_live_streams_lock);
+	fchip_filter_ctl_values(ctl, values);
+	list_for_each_entry(runtime_pr, &fchip_live_streams, live_node){
+		if(runtime_pr->filter_ctl != ctl){
+			continue;
+		}
+		if(fchip_filter_bank_update(&runtime_pr->filter_bank, values[FCHIP_FILTER_SETTING_TYPE], 
+			values[FCHIP_FILTER_SETTING_CUTOFF], values[FCHIP_FILTER_SETTING_SECTIONS], 
+			values[FCHIP_FILTER_SETTING_Q]))
+		{
+			printk(KERN_WARNING "fchip: failed to update the filter of a running stream\n");
+		}
+	}
+}
+
+// type, cutoff, Q and sections can be written at run time. a write
+// is the default of the mixer controls created from then on, and the
+// setting of the streams without controls; the values a card already
+// has in its controls stay. the running streams fade the new 
+// coefficients in (see fchip_filter_bank_update)
+static int fchip_filter_param_set(const char *val, const struct kernel_param *kp){
+	int err;
+
+	mutex_lock(&fchip_live_streams_lock);
+	err = param_set_int(val, kp);
+	if(err){
+		goto unlock;
+	}
+	fchip_pcm_validate_filter_params();
+	fchip_filter_ctl_apply(NULL);
+unlock:
+	mutex_unlock(&fchip_live_streams_lock);
+	return err;
+}
+
+static const struct kernel_param_ops fchip_filter_param_ops = {
+	.set = fchip_filter_param_set,
+	.get = param_get_int,
+};
 
-module_param(filter_type, int, 0444);
+module_param_cb(filter_type, &fchip_filter_param_ops, &filter_type, 0644);
 MODULE_PARM_DESC(filter_type, "Filter function type "
-    "(0 = No filtering, 1 = Lowpass, 2 = Hipass, 3 = Bandwidth, 4 = Mute)");
+    "(0 = No filtering, 1 = Lowpass, 2 = Hipass, 3 = Bandwidth, 4 = Mute, "
+	"5 = Linkwitz-Riley lowpass, 6 = Linkwitz-Riley hipass)");
 
-module_param(filter_cutoff_freq, int, 0444);
+module_param_cb(filter_cutoff_freq, &fchip_filter_param_ops, &filter_cutoff_freq, 0644);
 MODULE_PARM_DESC(filter_cutoff_freq, "Filter cutoff frequency (in Hz)");
 
+module_param_cb(filter_q, &fchip_filter_param_ops, &filter_q, 0644);
+MODULE_PARM_DESC(filter_q, "Q of the lowpass/hipass sections and of the bandpass, "
+	"in 1/100 (0 = Butterworth, up to 2000)");
+
+module_param_cb(filter_sections, &fchip_filter_param_ops, &filter_sections, 0644);
+MODULE_PARM_DESC(filter_sections, "Number of cascaded second-order sections for "
+	"lowpass/hipass filters (1-4, i.e. 12-48 dB/oct)");
+
+module_param(filter_engine, int, 0444);
+MODULE_PARM_DESC(filter_engine, "Filter structure "
+	"(0 = Direct form I, 1 = Transposed direct form II, 2 = Q31 fixed point, no FPU)");
+
+module_param(filter_worker, bool, 0444);
+MODULE_PARM_DESC(filter_worker, "Filter in a kernel thread per stream instead of the PCM callbacks");
+module_param(filter_worker_prio, int, 0444);
+MODULE_PARM_DESC(filter_worker_prio, "SCHED_FIFO priority of the filter threads (0 = SCHED_NORMAL)");
+module_param(filter_worker_cpu, int, 0444);
+MODULE_PARM_DESC(filter_worker_cpu, "CPU the filter threads run on (-1 = any)");
+module_param(filter_worker_margin_us, int, 0444);
+MODULE_PARM_DESC(filter_worker_margin_us, "How far ahead of the DMA the filter threads keep playback (in us, at least two periods)");
+
+module_param(position_estimate_us, uint, 0644);
+MODULE_PARM_DESC(position_estimate_us, "Extrapolate the playback pointer position for up to this long "
+	"after a hardware read (in us, 0 = always read the hardware)");
+
+module_param(tstamp_cache_ms, uint, 0644);
+MODULE_PARM_DESC(tstamp_cache_ms, "Interpolate link synchronized timestamps for up to this long "
+	"after a hardware crosstimestamp (in ms, 0 = always read the hardware)");
+module_param(tstamp_cache_max_err_ns, uint, 0644);
+MODULE_PARM_DESC(tstamp_cache_max_err_ns, "Stop interpolating when the interpolation was off by "
+	"more than this at the last hardware crosstimestamp (in ns)");
+
+module_param(filter_rounding, int, 0444);
+MODULE_PARM_DESC(filter_rounding, "Rounding of the Q31 filter engine "
+	"(0 = Truncate, 1 = Round to nearest, 2 = Error feedback)");
+
+
+// mixer controls: type, cutoff, Q and order for every PCM device 
+// and direction, e.g. "Playback Filter Cutoff" with the index of
+// the PCM device
+
+static const char * const fchip_filter_type_names[] = {
+	"None", "Lowpass", "Hipass", "Bandpass", "Mute", "LR Lowpass", "LR Hipass",
+};
+
+static const char * const fchip_filter_setting_names[FCHIP_FILTER_SETTING_COUNT] = {
+	"Filter Type", "Filter Cutoff", "Filter Q", "Filter Order",
+};
+
+#define FCHIP_FILTER_CUTOFF_MAX 96000
+
+static int fchip_filter_ctl_info(struct snd_kcontrol *kcontrol, struct snd_ctl_elem_info *uinfo){
+	uinfo->type = SNDRV_CTL_ELEM_TYPE_INTEGER;
+	uinfo->count = 1;
+	switch(kcontrol->private_value){
+		case FCHIP_FILTER_SETTING_TYPE:
+			return snd_ctl_enum_info(uinfo, 1, ARRAY_SIZE(fchip_filter_type_names), 
+				fchip_filter_type_names);
+		// the raw value is the frequency in Hz: there's no Hz TLV type
+		case FCHIP_FILTER_SETTING_CUTOFF:
+			uinfo->value.integer.min = 0;
+			uinfo->value.integer.max = FCHIP_FILTER_CUTOFF_MAX;
+			break;
+		case FCHIP_FILTER_SETTING_Q:
+			uinfo->value.integer.min = FCHIP_FILTER_Q_DEFAULT;
+			uinfo->value.integer.max = FCHIP_FILTER_Q_MAX;
+			break;
+		// shown as the filter order, i.e. 2 per section
+		case FCHIP_FILTER_SETTING_SECTIONS:
+			uinfo->value.integer.min = 2;
+			uinfo->value.integer.max = 2 * FCHIP_FILTER_MAX_SECTIONS;
+			uinfo->value.integer.step = 2;
+			break;
+	}
+	return 0;
+}
+
+static int fchip_filter_ctl_get(struct snd_kcontrol *kcontrol, struct snd_ctl_elem_value *ucontrol){
+	struct fchip_filter_ctl *ctl = snd_kcontrol_chip(kcontrol);
+	int setting = kcontrol->private_value;
+	int value;
+
+	mutex_lock(&fchip_live_streams_lock);
+	value = ctl->values[setting];
+	mutex_unlock(&fchip_live_streams_lock);
+
+	if(setting == FCHIP_FILTER_SETTING_TYPE){
+		ucontrol->value.enumerated.item[0] = value;
+		return 0;
+	}
+	if(setting == FCHIP_FILTER_SETTING_SECTIONS){
+		value *= 2;
+	}
+	ucontrol->value.integer.value[0] = value;
+	return 0;
+}
+
+static int fchip_filter_ctl_put(struct snd_kcontrol *kcontrol, struct snd_ctl_elem_value *ucontrol){
+	struct fchip_filter_ctl *ctl = snd_kcontrol_chip(kcontrol);
+	int setting = kcontrol->private_value;
+	long value;
+
+	switch(setting){
+		case FCHIP_FILTER_SETTING_TYPE:
+			value = ucontrol->value.enumerated.item[0];
+			if(value >= ARRAY_SIZE(fchip_filter_type_names)){
+				return -EINVAL;
+			}
+			break;
+		case FCHIP_FILTER_SETTING_CUTOFF:
+			value = ucontrol->value.integer.value[0];
+			if(value < 0 || value > FCHIP_FILTER_CUTOFF_MAX){
+				return -EINVAL;
+			}
+			break;
+		case FCHIP_FILTER_SETTING_Q:
+			value = ucontrol->value.integer.value[0];
+			if(value < FCHIP_FILTER_Q_DEFAULT || value > FCHIP_FILTER_Q_MAX){
+				return -EINVAL;
+			}
+			break;
+		// case FCHIP_FILTER_SETTING_SECTIONS:
+		default:
+			value = ucontrol->value.integer.value[0];
+			if(value % 2){
+				return -EINVAL;
+			}
+			value /= 2;
+			if(value < 1 || value > FCHIP_FILTER_MAX_SECTIONS){
+				return -EINVAL;
+			}
+	}
+
+	mutex_lock(&fchip_live_streams_lock);
+	if(ctl->values[setting] == value){
+		mutex_unlock(&fchip_live_streams_lock);
+		return 0;
+	}
+	ctl->values[setting] = value;
+	fchip_filter_ctl_apply(ctl);
+	mutex_unlock(&fchip_live_streams_lock);
+	return 1;
+}
+
+static void fchip_filter_ctl_destroy(struct fchip_filter_ctl *ctl){
+	mutex_lock(&fchip_live_streams_lock);
+	list_del(&ctl->list);
+	mutex_unlock(&fchip_live_streams_lock);
+	kfree(ctl);
+}
+
+static void fchip_filter_ctl_free(struct snd_kcontrol *kcontrol){
+	fchip_filter_ctl_destroy(snd_kcontrol_chip(kcontrol));
+}
+
+int fchip_pcm_add_filter_controls(struct snd_pcm *pcm, int stream){
+	struct snd_kcontrol_new tmpl = {
+		.iface = SNDRV_CTL_ELEM_IFACE_MIXER,
+		.index = pcm->device,
+		.access = SNDRV_CTL_ELEM_ACCESS_READWRITE,
+		.info = fchip_filter_ctl_info,
+		.get = fchip_filter_ctl_get,
+		.put = fchip_filter_ctl_put,
+	};
+	struct fchip_filter_ctl *ctl;
+	char name[SNDRV_CTL_ELEM_ID_NAME_MAXLEN];
+	int setting, err;
+
+	ctl = kzalloc(sizeof(*ctl), GFP_KERNEL);
+	if(!ctl){
+		return -ENOMEM;
+	}
+	ctl->pcm = pcm;
+	ctl->stream = stream;
+
+	mutex_lock(&fchip_live_streams_lock);
+	fchip_filter_ctl_values(NULL, ctl->values);
+	list_add(&ctl->list, &fchip_filter_ctls);
+	mutex_unlock(&fchip_live_streams_lock);
+
+	tmpl.name = name;
+	for(setting = 0; setting < FCHIP_FILTER_SETTING_COUNT; setting++){
+		snprintf(name, sizeof(name), "%s %s", 
+			stream == SNDRV_PCM_STREAM_PLAYBACK ? "Playback" : "Capture", 
+			fchip_filter_setting_names[setting]);
+		tmpl.private_value = setting;
+
+		ctl->kctls[setting] = snd_ctl_new1(&tmpl, ctl);
+		if(!ctl->kctls[setting]){
+			if(setting == 0){
+				fchip_filter_ctl_destroy(ctl);
+			}
+			return -ENOMEM;
+		}
+		// the first control owns the settings
+		if(setting == 0){
+			ctl->kctls[setting]->private_free = fchip_filter_ctl_free;
+		}
+		err = snd_ctl_add(pcm->card, ctl->kctls[setting]);
+		if(err < 0){
+			// snd_ctl_add frees the control on failure; the settings
+			// went with it if it was the first one
+			if(setting != 0){
+				mutex_lock(&fchip_live_streams_lock);
+				ctl->kctls[setting] = NULL;
+				mutex_unlock(&fchip_live_streams_lock);
+			}
+			return err;
+		}
+	}
+	return 0;
+}
+
+// read-only "Playback/Capture Clock Drift" PCM controls, for resamplers
+// and clock recovery: the controller clock against CLOCK_MONOTONIC_RAW
+// as measured by the open stream (see fchip_drift_record), in ppb, the
+// mean deviation of the readings, and how many went into it. all zero 
+// while no stream is open or before its first reading
+static int fchip_drift_ctl_info(struct snd_kcontrol *kcontrol, struct snd_ctl_elem_info *uinfo){
+	uinfo->type = SNDRV_CTL_ELEM_TYPE_INTEGER64;
+	uinfo->count = 3;
+	uinfo->value.integer64.min = S64_MIN;
+	uinfo->value.integer64.max = S64_MAX;
+	return 0;
+}
+
+static int fchip_drift_ctl_get(struct snd_kcontrol *kcontrol, struct snd_ctl_elem_value *ucontrol){
+	struct snd_pcm *pcm = snd_kcontrol_chip(kcontrol);
+	struct azx_pcm *apcm = pcm->private_data;
+	struct hdac_bus *bus = azx_to_hda_bus(apcm->chip);
+	struct snd_pcm_substream *substream;
+	struct fchip_runtime_pr *pr;
+	struct fchip_drift *drift;
+
+	ucontrol->value.integer64.value[0] = 0;
+	ucontrol->value.integer64.value[1] = 0;
+	ucontrol->value.integer64.value[2] = 0;
+
+	// the runtime goes away under pcm->open_mutex
+	mutex_lock(&pcm->open_mutex);
+	for(substream = pcm->streams[kcontrol->private_value].substream; substream; substream = substream->next){
+		if(!substream->runtime || !substream->runtime->private_data){
+			continue;
+		}
+		pr = substream->runtime->private_data;
+		drift = &pr->dev->drift;
+		spin_lock_irq(&bus->reg_lock);
+		ucontrol->value.integer64.value[0] = drift->ppb;
+		ucontrol->value.integer64.value[1] = drift->dev_ppb;
+		ucontrol->value.integer64.value[2] = drift->windows;
+		spin_unlock_irq(&bus->reg_lock);
+		break;
+	}
+	mutex_unlock(&pcm->open_mutex);
+	return 0;
+}
+
+int fchip_pcm_add_drift_control(struct snd_pcm *pcm, int stream){
+	struct snd_kcontrol_new tmpl = {
+		.iface = SNDRV_CTL_ELEM_IFACE_PCM,
+		.device = pcm->device,
+		.name = stream == SNDRV_PCM_STREAM_PLAYBACK ? "Playback Clock Drift" : "Capture Clock Drift",
+		.access = SNDRV_CTL_ELEM_ACCESS_READ | SNDRV_CTL_ELEM_ACCESS_VOLATILE,
+		.info = fchip_drift_ctl_info,
+		.get = fchip_drift_ctl_get,
+		.private_value = stream,
+	};
+	struct snd_kcontrol *kctl = snd_ctl_new1(&tmpl, pcm);
+
+	if(!kctl){
+		return -ENOMEM;
+	}
+	return snd_ctl_add(pcm->card, kctl);
+}
+
+static struct fchip_filter_ctl *fchip_filter_ctl_find(struct snd_pcm_substream *substream){
+	struct fchip_filter_ctl *ctl;
+
+	lockdep_assert_held(&fchip_live_streams_lock);
+	list_for_each_entry(ctl, &fchip_filter_ctls, list){
+		if(ctl->pcm == substream->pcm && ctl->stream == substream->stream){
+			return ctl;
+		}
+	}
+	return NULL;
+}
+
 
 void fchip_pcm_validate_filter_params(void){
 	if(
 		!(
 			filter_type>=FCHIP_FILTER_NONE && 
-			filter_type<=FCHIP_FILTER_MUTE
+			filter_type<=FCHIP_FILTER_LR_HIPASS
 		)
 	)
 	{
@@ -30,6 +408,41 @@ void fchip_pcm_validate_filter_params(void){
 		printk(KERN_WARNING "fchip: invalid filter cutoff frequency specified, defaulting to 1000 Hz\n");
 		filter_cutoff_freq = 1000;
 	}
+
+	if(filter_q < FCHIP_FILTER_Q_DEFAULT || filter_q > FCHIP_FILTER_Q_MAX){
+		printk(KERN_WARNING "fchip: invalid filter Q specified, defaulting to Butterworth\n");
+		filter_q = FCHIP_FILTER_Q_DEFAULT;
+	}
+
+	if(filter_sections < 1 || filter_sections > FCHIP_FILTER_MAX_SECTIONS){
+		printk(KERN_WARNING "fchip: invalid filter section count specified, defaulting to 1\n");
+		filter_sections = 1;
+	}
+
+	if(filter_worker_prio < 0 || filter_worker_prio >= MAX_RT_PRIO){
+		printk(KERN_WARNING "fchip: invalid filter thread priority specified, defaulting to 50\n");
+		filter_worker_prio = 50;
+	}
+
+	if(filter_worker_cpu >= (int)nr_cpu_ids){
+		printk(KERN_WARNING "fchip: invalid filter thread CPU specified, running on any\n");
+		filter_worker_cpu = -1;
+	}
+
+	if(filter_worker_margin_us < 0){
+		printk(KERN_WARNING "fchip: invalid filter thread margin specified, defaulting to 2000 us\n");
+		filter_worker_margin_us = 2000;
+	}
+
+	if(filter_engine < FCHIP_ENGINE_DF1 || filter_engine > FCHIP_ENGINE_Q31){
+		printk(KERN_WARNING "fchip: invalid filter engine specified, defaulting to direct form I\n");
+		filter_engine = FCHIP_ENGINE_DF1;
+	}
+
+	if(filter_rounding < FCHIP_ROUNDING_TRUNCATE || filter_rounding > FCHIP_ROUNDING_ERROR_FEEDBACK){
+		printk(KERN_WARNING "fchip: invalid filter rounding specified, defaulting to round to nearest\n");
+		filter_rounding = FCHIP_ROUNDING_NEAREST;
+	}
 }
 
 static const struct snd_pcm_hardware fchip_pcm_hw = {
@@ -43,6 +456,7 @@ static const struct snd_pcm_hardware fchip_pcm_hw = {
 				 SNDRV_PCM_INFO_SYNC_START |
 				 SNDRV_PCM_INFO_HAS_WALL_CLOCK | /* legacy */
 				 SNDRV_PCM_INFO_HAS_LINK_ATIME |
+				 SNDRV_PCM_INFO_SYNC_APPLPTR | /* see fchip_pcm_ack */
 				 SNDRV_PCM_INFO_NO_PERIOD_WAKEUP),
 	.formats =		SNDRV_PCM_FMTBIT_S16_LE,
 	.rates =		SNDRV_PCM_RATE_48000,
@@ -93,10 +507,7 @@ static unsigned int fchip_pcm_get_position(struct fchip_azx *chip,
 	int stream = substream->stream;
 	int delay = 0;
 
-	if (chip->get_position[stream])
-		pos = chip->get_position[stream](chip, azx_dev);
-	else // use the position buffer as default
-		pos = fchip_get_pos_posbuf(chip, azx_dev);
+	pos = fchip_get_position(chip, azx_dev, stream);
 
 	if (pos >= azx_dev->core.bufsize)
 		pos = 0;
@@ -105,8 +516,7 @@ static unsigned int fchip_pcm_get_position(struct fchip_azx *chip,
 		struct azx_pcm *apcm = snd_pcm_substream_chip(substream);
 		struct hda_pcm_stream *hinfo = to_hda_pcm_stream(substream);
 
-		if (chip->get_delay[stream])
-			delay += chip->get_delay[stream](chip, azx_dev, pos);
+		delay += fchip_get_delay(chip, azx_dev, stream, pos);
 		if (hinfo->ops.get_delay)
 			delay += hinfo->ops.get_delay(hinfo, apcm->codec,
 						      substream);
@@ -116,37 +526,351 @@ static unsigned int fchip_pcm_get_position(struct fchip_azx *chip,
 	return pos;
 }
 
+// whether pos is behind last, i.e. less than half a buffer back
+static inline bool fchip_pos_behind(unsigned int pos, unsigned int last, unsigned int bufsize)
+{
+	unsigned int back = (last + bufsize - pos) % bufsize;
+
+	return back && back < bufsize / 2;
+}
+
+// with position_estimate_us, the pointer callback reads the hardware 
+// (the position and, with LPIB delay, another register) only once per 
+// interval and after period interrupts. in between, the position is 
+// extrapolated from that read at the stream rate, and the delay kept.
+// the hardware moves in DMA bursts, so an estimate can be ahead of the
+// next read; the position is then held to never go backwards.
+// playback only: capture is filtered up to the position and handed to
+// the application, so an estimate ahead of the DMA would expose (and 
+// filter) frames the hardware hasn't written yet
+static unsigned int fchip_pcm_estimate_position(struct fchip_azx *chip,
+			      struct azx_dev *azx_dev)
+{
+	struct fchip_pos_estimator *est = &azx_dev->estimator;
+	struct snd_pcm_runtime *runtime = azx_dev->core.substream->runtime;
+	unsigned int bufsize = azx_dev->core.bufsize;
+	unsigned int interval_us = READ_ONCE(position_estimate_us);
+	unsigned int pos, guess = 0;
+	u64 now, elapsed;
+	int err;
+
+	if (!interval_us || !runtime || !azx_dev->core.running || !bufsize ||
+	    azx_dev->core.substream->stream == SNDRV_PCM_STREAM_CAPTURE) {
+		est->anchored = false;
+		return fchip_pcm_get_position(chip, azx_dev);
+	}
+
+	now = ktime_get_ns();
+	elapsed = now - est->anchor_ns;
+	if (est->anchored) {
+		guess = (est->anchor_pos + frames_to_bytes(runtime, 
+			div_u64(elapsed * runtime->rate, NSEC_PER_SEC))) % bufsize;
+	}
+
+	if (est->anchored && !READ_ONCE(est->resync) && elapsed < (u64)interval_us * NSEC_PER_USEC) {
+		est->estimates++;
+		est->reads_saved += est->reads_per_update;
+		runtime->delay = est->anchor_delay;
+		pos = guess;
+	} else {
+		WRITE_ONCE(est->resync, false);
+		pos = fchip_pcm_get_position(chip, azx_dev);
+		est->updates++;
+		if (est->anchored) {
+			err = (int)((guess + bufsize - pos) % bufsize);
+			if (err >= bufsize / 2) {
+				err -= (int)bufsize;
+			}
+			err = err / (int)(runtime->frame_bits / 8);
+			est->err_min = est->err_samples ? min(est->err_min, err) : err;
+			est->err_max = est->err_samples ? max(est->err_max, err) : err;
+			est->err_abs_sum += abs(err);
+			est->err_samples++;
+		}
+		est->anchor_ns = now;
+		est->anchor_pos = pos;
+		est->anchor_delay = runtime->delay;
+		est->reads_per_update = 1 + (READ_ONCE(chip->delay_method[azx_dev->core.substream->stream]) != FCHIP_DELAY_NONE);
+		if (!est->anchored) {
+			est->last = pos;
+		}
+		est->anchored = true;
+	}
+
+	if (fchip_pos_behind(pos, est->last, bufsize)) {
+		est->held++;
+		pos = est->last;
+	}
+	est->last = pos;
+	return pos;
+}
+
 static inline void fchip_filter_process_region(snd_pcm_uframes_t total_frames, void *data_ptr, struct fchip_runtime_pr *pr){
-	int channels = pr->filter_channels;
-	int32_t *casted_data_ptr = (int32_t*)data_ptr; 
-	struct fchip_channel_filter *filters = pr->filters;
-	int bit_shift = pr->bit_shift;
-	int sample_max_value = pr->sample_max_value;
-	
-    snd_pcm_uframes_t frame;
-	int channel_idx;
+	u64 start = ktime_get_ns();
 
-	float raw;
-	float processed;
-	int32_t raw_i;
-	int32_t processed_i;
+	fchip_filter_process_block(&pr->filter_bank, (int32_t*)data_ptr, total_frames, 
+		pr->filter_channels, pr->bit_shift);
 
+	pr->filter_ns += ktime_get_ns() - start;
+	pr->filter_section_samples += (u64)total_frames * pr->filter_channels * 
+		pr->filter_bank.filters[0].active_sections;
+}
 
-    for(frame = 0; frame<total_frames; frame++){
-        for(channel_idx = 0; channel_idx<channels; channel_idx++){
 
-            raw_i = (*casted_data_ptr)>>bit_shift;
-            raw = (raw_i*1.0f)/sample_max_value; 
+// filters `frames` of the ring buffer starting at filter_ptr. with a
+// shadow (see fchip_pcm_shadow_alloc) that is where the frames are 
+// filtered, the result is streamed out to the DMA area with 
+// non-temporal stores and a single fence
+static void fchip_filter_ring(struct snd_pcm_runtime *runtime, struct fchip_runtime_pr *pr, 
+	snd_pcm_uframes_t frames){
 
-            processed = fchip_filter_process(&filters[channel_idx], raw);
-            processed_i = (int32_t)(processed*sample_max_value);
-            
-            *casted_data_ptr = (processed_i<<bit_shift); 
-            casted_data_ptr++;
-        }
-    }	
+	snd_pcm_uframes_t from = pr->filter_ptr % runtime->buffer_size;
+	snd_pcm_uframes_t chunk;
+	ssize_t frame_in_bytes = runtime->frame_bits / 8;
+	unsigned char *area = pr->shadow ? pr->shadow : runtime->dma_area;
+
+	if(!frames){
+		return;
+	}
+	while(frames){
+		chunk = min(frames, runtime->buffer_size - from);
+		// no filters (see fchip_filter_prepare): a shadow still has 
+		// to reach the DMA area
+		if(pr->filter_channels){
+			fchip_filter_process_region(chunk, area + from * frame_in_bytes, pr);
+		}
+		if(pr->shadow){
+			memcpy_flushcache(runtime->dma_area + from * frame_in_bytes, 
+				area + from * frame_in_bytes, chunk * frame_in_bytes);
+		}
+		frames -= chunk;
+		from = 0;
+	}
+	if(pr->shadow){
+		wmb();
+	}
+}
+
+// a - b for positions in appl_ptr/hw_ptr units, i.e. modulo the boundary
+static snd_pcm_sframes_t fchip_ptr_diff(struct snd_pcm_runtime *runtime, 
+	snd_pcm_uframes_t a, snd_pcm_uframes_t b){
+
+	snd_pcm_sframes_t diff = a - b;
+
+	if(diff < 0){
+		diff += runtime->boundary;
+	}
+	if(diff >= (snd_pcm_sframes_t)(runtime->boundary / 2)){
+		diff -= runtime->boundary;
+	}
+	return diff;
+}
+
+static void fchip_filter_advance(struct snd_pcm_runtime *runtime, struct fchip_runtime_pr *pr, 
+	snd_pcm_uframes_t frames){
+
+	pr->filter_ptr += frames;
+	if(pr->filter_ptr >= runtime->boundary){
+		pr->filter_ptr -= runtime->boundary;
+	}
+}
+
+// .copy runs without the stream lock and .ack under it, so one of them 
+// may be filtering (filter_ptr and the bank history) when the other 
+// one comes. the one that doesn't get the claim leaves its frames to 
+// the next fchip_pcm_ack
+static bool fchip_filter_claim(struct fchip_runtime_pr *pr){
+	return atomic_cmpxchg_acquire(&pr->filter_busy, 0, 1) == 0;
+}
+
+static void fchip_filter_release(struct fchip_runtime_pr *pr){
+	atomic_set_release(&pr->filter_busy, 0);
+}
+
+// committed playback frames that aren't filtered yet. a rewind moves 
+// filter_ptr back: the frames after appl_ptr are going to be written again
+static snd_pcm_sframes_t fchip_filter_playback_avail(struct snd_pcm_runtime *runtime, 
+	struct fchip_runtime_pr *pr){
+
+	snd_pcm_uframes_t appl_ptr = READ_ONCE(runtime->control->appl_ptr);
+	snd_pcm_sframes_t frames = fchip_ptr_diff(runtime, appl_ptr, pr->filter_ptr);
+
+	if(frames < 0 || frames > (snd_pcm_sframes_t)runtime->buffer_size){
+		pr->filter_ptr = appl_ptr;
+		return 0;
+	}
+	return frames;
+}
+
+// the filter thread (filter_worker=1). the PCM callbacks only kick it,
+// so no filtering runs with interrupts off or under the stream lock.
+// playback is filtered just in time, up to worker_margin frames ahead 
+// of the DMA: the work is spread over the periods and the mixer 
+// controls act after the margin instead of after a full buffer. 
+// capture is filtered up to the DMA position, and the pointer callback
+// reports how far it got
+static void fchip_filter_worker_kick(struct fchip_runtime_pr *pr){
+	atomic_set(&pr->worker_kick, 1);
+	wake_up(&pr->worker_wait);
+}
+
+static void fchip_filter_worker_playback(struct snd_pcm_substream *substream){
+	struct snd_pcm_runtime *runtime = substream->runtime;
+	struct fchip_runtime_pr *pr = runtime->private_data;
+	snd_pcm_uframes_t hw_ptr;
+	snd_pcm_sframes_t frames, late, ahead;
+
+	// the pointers move under the stream lock (interrupt, ack); the 
+	// filtering itself runs without it
+	snd_pcm_stream_lock_irq(substream);
+	hw_ptr = runtime->status->hw_ptr;
+	frames = fchip_filter_playback_avail(runtime, pr);
+	snd_pcm_stream_unlock_irq(substream);
+
+	// the DMA got past filter_ptr: those frames went out unfiltered
+	late = fchip_ptr_diff(runtime, hw_ptr, pr->filter_ptr);
+	if(late > 0){
+		late = min(late, frames);
+		pr->worker_late += late;
+		fchip_filter_advance(runtime, pr, late);
+		frames -= late;
+	}
+
+	ahead = fchip_ptr_diff(runtime, pr->filter_ptr, hw_ptr);
+	frames = clamp_t(snd_pcm_sframes_t, (snd_pcm_sframes_t)pr->worker_margin - ahead, 0, frames);
+	fchip_filter_ring(runtime, pr, frames);
+	fchip_filter_advance(runtime, pr, frames);
+}
+
+static void fchip_filter_worker_capture(struct snd_pcm_substream *substream){
+	struct azx_pcm *apcm = snd_pcm_substream_chip(substream);
+	struct snd_pcm_runtime *runtime = substream->runtime;
+	struct fchip_runtime_pr *pr = runtime->private_data;
+	snd_pcm_uframes_t pos, from = pr->filter_ptr;
+	snd_pcm_sframes_t frames;
+
+	// fchip_pcm_get_position updates runtime->delay and may switch the
+	// position method: as from the pointer callback, under the stream lock
+	snd_pcm_stream_lock_irq(substream);
+	pos = bytes_to_frames(runtime, fchip_pcm_get_position(apcm->chip, pr->dev));
+	snd_pcm_stream_unlock_irq(substream);
+	frames = pos - from;
+	if(frames < 0){
+		frames += runtime->buffer_size;
+	}
+	if(!frames){
+		return;
+	}
+
+	fchip_filter_ring(runtime, pr, frames);
+	WRITE_ONCE(pr->filter_ptr, pos);
+	// the application only sees filtered frames (fchip_pcm_pointer), so
+	// it's woken up from here once a period boundary is passed, and not
+	// by the interrupt (fchip_pcm_period_elapsed)
+	if(from / runtime->period_size != pos / runtime->period_size || pos < from){
+		snd_pcm_period_elapsed(substream);
+	}
 }
 
+// a capture stream with a filter thread only kicks it: the thread 
+// notifies once the frames of the period are filtered, a notification
+// from here as well would wake the application twice per period
+void fchip_pcm_period_elapsed(struct snd_pcm_substream *substream)
+{
+	struct fchip_runtime_pr *pr = substream->runtime->private_data;
+
+	if(substream->stream == SNDRV_PCM_STREAM_CAPTURE && READ_ONCE(pr->worker)){
+		fchip_filter_worker_kick(pr);
+		return;
+	}
+	snd_pcm_period_elapsed(substream);
+}
+
+static int fchip_filter_worker(void *data){
+	struct snd_pcm_substream *substream = data;
+	struct fchip_runtime_pr *pr = substream->runtime->private_data;
+
+	while(!kthread_should_stop()){
+		wait_event_interruptible(pr->worker_wait, 
+			atomic_xchg(&pr->worker_kick, 0) || kthread_should_stop());
+
+		mutex_lock(&pr->worker_lock);
+		if(pr->filter_channels){
+			if(substream->stream == SNDRV_PCM_STREAM_PLAYBACK){
+				fchip_filter_worker_playback(substream);
+			}
+			else{
+				fchip_filter_worker_capture(substream);
+			}
+		}
+		mutex_unlock(&pr->worker_lock);
+	}
+	return 0;
+}
+
+// not fatal: without the thread the stream filters in its callbacks
+static void fchip_filter_worker_start(struct snd_pcm_substream *substream){
+	struct fchip_runtime_pr *pr = substream->runtime->private_data;
+	struct sched_attr attr = {
+		.sched_policy = SCHED_FIFO,
+		.sched_priority = filter_worker_prio,
+	};
+	struct task_struct *task;
+	int err;
+
+	task = kthread_create(fchip_filter_worker, substream, "fchip-filter-%dD%d%c", 
+		substream->pcm->card->number, substream->pcm->device, 
+		substream->stream == SNDRV_PCM_STREAM_PLAYBACK ? 'p' : 'c');
+	if(IS_ERR(task)){
+		printk(KERN_WARNING "fchip: cannot start the filter thread (%ld)\n", PTR_ERR(task));
+		return;
+	}
+
+	if(filter_worker_prio){
+		err = sched_setattr_nocheck(task, &attr);
+		if(err){
+			printk(KERN_WARNING "fchip: cannot make the filter thread SCHED_FIFO (%d)\n", err);
+		}
+	}
+	if(filter_worker_cpu >= 0){
+		err = set_cpus_allowed_ptr(task, cpumask_of(filter_worker_cpu));
+		if(err){
+			printk(KERN_WARNING "fchip: cannot move the filter thread to CPU %d (%d)\n", 
+				filter_worker_cpu, err);
+		}
+	}
+
+	pr->worker = task;
+	wake_up_process(task);
+}
+
+// playback: the application committed frames up to appl_ptr (write(),
+// or SYNC_PTR for mmap clients thanks to SNDRV_PCM_INFO_SYNC_APPLPTR).
+// filtering them here keeps the cost out of the period interrupt and
+// spreads it over the commits
+int fchip_pcm_ack(struct snd_pcm_substream *substream)
+{
+	struct snd_pcm_runtime *runtime = substream->runtime;
+	struct fchip_runtime_pr *runtime_pr = runtime->private_data;
+	snd_pcm_sframes_t frames;
+
+	if(substream->stream != SNDRV_PCM_STREAM_PLAYBACK){
+		return 0;
+	}
+	if(runtime_pr->worker){
+		fchip_filter_worker_kick(runtime_pr);
+		return 0;
+	}
+
+	if(!fchip_filter_claim(runtime_pr)){
+		return 0;
+	}
+	frames = fchip_filter_playback_avail(runtime, runtime_pr);
+	fchip_filter_ring(runtime, runtime_pr, frames);
+	fchip_filter_advance(runtime, runtime_pr, frames);
+	fchip_filter_release(runtime_pr);
+	return 0;
+}
 
 snd_pcm_uframes_t fchip_pcm_pointer(struct snd_pcm_substream *substream)
 {
@@ -154,75 +878,212 @@ snd_pcm_uframes_t fchip_pcm_pointer(struct snd_pcm_substream *substream)
 	struct fchip_azx *chip = apcm->chip;
 	struct snd_pcm_runtime *runtime = substream->runtime;
 	struct fchip_runtime_pr *runtime_pr = runtime->private_data;
-
-	snd_pcm_uframes_t sw_ptr;
-	snd_pcm_uframes_t filter_ptr;
-	unsigned char *dma_area;
-	unsigned int buffer_size;
-	ssize_t frame_in_bytes;
 	snd_pcm_uframes_t res;
+	snd_pcm_sframes_t frames;
 
-	buffer_size = runtime->buffer_size;
-	frame_in_bytes = runtime->frame_bits / 8;
+	res = bytes_to_frames(runtime, fchip_pcm_estimate_position(chip, runtime_pr->dev));
 
-	sw_ptr = runtime->control->appl_ptr % buffer_size;
-	filter_ptr = runtime_pr->filter_ptr % buffer_size;
-	dma_area = runtime->dma_area;
+	if(runtime_pr->worker){
+		fchip_filter_worker_kick(runtime_pr);
+		if(substream->stream == SNDRV_PCM_STREAM_CAPTURE){
+			return READ_ONCE(runtime_pr->filter_ptr);
+		}
+		return res;
+	}
 
-	res = bytes_to_frames(runtime, fchip_pcm_get_position(chip, runtime_pr->dev));
+	// capture is filtered as the hardware fills the buffer, so it's done
+	// before the application sees it; playback is done in fchip_pcm_ack
+	if(substream->stream == SNDRV_PCM_STREAM_CAPTURE){
+		// from the period interrupt the FPU may be taken: the frames 
+		// are filtered and reported by the next call then
+		if(!fchip_filter_bank_runnable(&runtime_pr->filter_bank)){
+			return runtime_pr->filter_ptr;
+		}
+		frames = res - runtime_pr->filter_ptr;
+		if(frames < 0){
+			frames += runtime->buffer_size;
+		}
+		fchip_filter_ring(runtime, runtime_pr, frames);
+		runtime_pr->filter_ptr = res;
+	}
 
-	if(substream->stream == SNDRV_PCM_STREAM_PLAYBACK){
-		if (filter_ptr != sw_ptr) {
-			if (filter_ptr < sw_ptr) {
-				fchip_filter_process_region(sw_ptr-filter_ptr, dma_area+filter_ptr*frame_in_bytes, runtime_pr);
-			} 
-			else {
-				fchip_filter_process_region(buffer_size-filter_ptr, dma_area+filter_ptr*frame_in_bytes, runtime_pr);
-				fchip_filter_process_region(sw_ptr, dma_area, runtime_pr);
-			}
-			runtime_pr->filter_ptr = sw_ptr;
+	return res;
+}
+
+static int fchip_pcm_copy_plain(unsigned char *dst, struct iov_iter *iter, unsigned long bytes){
+	if(copy_from_iter(dst, bytes, iter) != bytes){
+		return -EFAULT;
+	}
+	return 0;
+}
+
+// the non-mmap read/write path. playback takes the frames from the 
+// user iterator into a small bounce buffer, filters them while they 
+// are in cache and stores them into the DMA area once, non-temporally:
+// no read back of a possibly uncached buffer. fchip_pcm_ack then finds
+// them filtered already. with a shadow the frames go through it 
+// instead, as for mmap: an application may mix write() and mmap, and 
+// the shadow has to hold what the DMA area holds. called with the 
+// claim (fchip_filter_claim), and pos at filter_ptr
+static int fchip_pcm_copy_filtered(struct snd_pcm_runtime *runtime, struct fchip_runtime_pr *runtime_pr, 
+	unsigned long pos, struct iov_iter *iter, unsigned long bytes){
+
+	unsigned char *dst = runtime->dma_area + pos;
+	ssize_t frame_in_bytes = runtime->frame_bits / 8;
+	snd_pcm_uframes_t frames = bytes / frame_in_bytes;
+	snd_pcm_uframes_t chunk;
+
+	if(runtime_pr->shadow){
+		if(copy_from_iter(runtime_pr->shadow + pos, bytes, iter) != bytes){
+			return -EFAULT;
 		}
+		fchip_filter_ring(runtime, runtime_pr, frames);
+		fchip_filter_advance(runtime, runtime_pr, frames);
+		return 0;
 	}
-	else{
-		if(filter_ptr != res){
-			if(filter_ptr < res){
-				fchip_filter_process_region(res-filter_ptr, dma_area+filter_ptr*frame_in_bytes, runtime_pr);
-			}
-			else{
-				fchip_filter_process_region(buffer_size-filter_ptr, dma_area+filter_ptr*frame_in_bytes, runtime_pr);
-				fchip_filter_process_region(res, dma_area, runtime_pr);
-			}
-			runtime_pr->filter_ptr = sw_ptr;
+
+	while(frames){
+		chunk = min_t(snd_pcm_uframes_t, frames, FCHIP_COPY_FRAMES);
+		if(copy_from_iter(runtime_pr->copy_buf, chunk * frame_in_bytes, iter) != chunk * frame_in_bytes){
+			return -EFAULT;
 		}
+		fchip_filter_process_region(chunk, runtime_pr->copy_buf, runtime_pr);
+		memcpy_flushcache(dst, runtime_pr->copy_buf, chunk * frame_in_bytes);
+		fchip_filter_advance(runtime, runtime_pr, chunk);
+		dst += chunk * frame_in_bytes;
+		frames -= chunk;
+	}
+	// the non-temporal stores have to land before the DMA gets there
+	wmb();
+	return 0;
+}
+
+static int fchip_pcm_copy_playback(struct snd_pcm_substream *substream, unsigned long pos, 
+	struct iov_iter *iter, unsigned long bytes){
+
+	struct snd_pcm_runtime *runtime = substream->runtime;
+	struct fchip_runtime_pr *runtime_pr = runtime->private_data;
+	unsigned char *area = runtime_pr->shadow ? runtime_pr->shadow : runtime->dma_area;
+	ssize_t frame_in_bytes = runtime->frame_bits / 8;
+	int err;
+
+	// only in order with filter_ptr, e.g. not for a partial frame, and
+	// not while fchip_pcm_ack filters; anything else is a plain copy 
+	// and left to fchip_pcm_ack
+	if(bytes % frame_in_bytes || !runtime_pr->filter_channels || runtime_pr->worker ||
+		!fchip_filter_claim(runtime_pr)){
+		return fchip_pcm_copy_plain(area + pos, iter, bytes);
 	}
 
-	return res;
+	if(bytes_to_frames(runtime, pos) != runtime_pr->filter_ptr % runtime->buffer_size){
+		err = fchip_pcm_copy_plain(area + pos, iter, bytes);
+	}
+	else{
+		err = fchip_pcm_copy_filtered(runtime, runtime_pr, pos, iter, bytes);
+	}
+	fchip_filter_release(runtime_pr);
+	return err;
+}
+
+int fchip_pcm_copy(struct snd_pcm_substream *substream, int channel, unsigned long pos, 
+	struct iov_iter *iter, unsigned long bytes)
+{
+	struct snd_pcm_runtime *runtime = substream->runtime;
+
+	// interleaved only (fchip_pcm_hw), so channel is always -1
+	if(substream->stream == SNDRV_PCM_STREAM_PLAYBACK){
+		return fchip_pcm_copy_playback(substream, pos, iter, bytes);
+	}
+	if(copy_to_iter(runtime->dma_area + pos, bytes, iter) != bytes){
+		return -EFAULT;
+	}
+	return 0;
 }
 
-static struct fchip_runtime_pr *fchip_runtime_private_init(struct azx_dev *azx_dev, int channel_count){
+static struct fchip_runtime_pr *fchip_runtime_private_init(struct snd_pcm_substream *substream, 
+	struct azx_dev *azx_dev, int channel_count){
 	
+	struct azx_pcm *apcm = snd_pcm_substream_chip(substream);
 	struct fchip_runtime_pr *runtime_pr = kmalloc(sizeof(*runtime_pr), GFP_KERNEL);
+	int values[FCHIP_FILTER_SETTING_COUNT];
 	if(!runtime_pr){
 		return NULL;
 	}
 	runtime_pr->dev = azx_dev;
 	runtime_pr->filter_ptr = 0;
+	atomic_set(&runtime_pr->filter_busy, 0);
 	runtime_pr->filter_channels = 0;
-	runtime_pr->filter_count = channel_count;
-	runtime_pr->filters = kmalloc(sizeof(struct fchip_channel_filter)*channel_count, GFP_KERNEL); 
-	if(!runtime_pr->filters){
+	runtime_pr->filter_ns = 0;
+	runtime_pr->filter_section_samples = 0;
+	runtime_pr->copy_buf = NULL;
+	runtime_pr->shadow = NULL;
+	runtime_pr->worker = NULL;
+	runtime_pr->worker_late = 0;
+	runtime_pr->worker_margin = 0;
+	memset(&runtime_pr->tstamp, 0, sizeof(runtime_pr->tstamp));
+	init_waitqueue_head(&runtime_pr->worker_wait);
+	atomic_set(&runtime_pr->worker_kick, 0);
+	mutex_init(&runtime_pr->worker_lock);
+	if(substream->stream == SNDRV_PCM_STREAM_PLAYBACK){
+		runtime_pr->copy_buf = kmalloc_array(FCHIP_COPY_FRAMES * channel_count, sizeof(s32), GFP_KERNEL);
+		if(!runtime_pr->copy_buf){
+			kfree(runtime_pr);
+			return NULL;
+		}
+	}
+	if(fchip_filter_bank_init(&runtime_pr->filter_bank, channel_count)){
+		kfree(runtime_pr->copy_buf);
 		kfree(runtime_pr);
 		return NULL;
 	}
-
-	for(int i=0; i<channel_count; i++){
-		// init cutoff and filter types here once, do not change 
-		// them later (pass the corresponding parameters)
-		fchip_filter_change_params(&runtime_pr->filters[i], filter_type, 48000, filter_cutoff_freq);
+	runtime_pr->filter_bank.user_slot = fchip_hwdep_slot(apcm->chip, substream);
+
+	// init cutoff and filter types here from the mixer controls of the
+	// PCM device; prepare only passes the rate, later changes come from 
+	// fchip_filter_ctl_apply
+	mutex_lock(&fchip_live_streams_lock);
+	runtime_pr->filter_ctl = fchip_filter_ctl_find(substream);
+	fchip_filter_ctl_values(runtime_pr->filter_ctl, values);
+	if(fchip_filter_bank_change_params(&runtime_pr->filter_bank, values[FCHIP_FILTER_SETTING_TYPE], 48000, 
+		values[FCHIP_FILTER_SETTING_CUTOFF], values[FCHIP_FILTER_SETTING_SECTIONS], values[FCHIP_FILTER_SETTING_Q])){
+		mutex_unlock(&fchip_live_streams_lock);
+		fchip_filter_bank_free(&runtime_pr->filter_bank);
+		kfree(runtime_pr->copy_buf);
+		kfree(runtime_pr);
+		return NULL;
 	}
+	list_add(&runtime_pr->live_node, &fchip_live_streams);
+	mutex_unlock(&fchip_live_streams_lock);
+
+	fchip_filter_bank_set_engine(&runtime_pr->filter_bank, filter_engine, filter_rounding);
 	return runtime_pr;
 }
 
+static void fchip_runtime_private_free(struct fchip_runtime_pr *runtime_pr){
+	if(runtime_pr->worker){
+		kthread_stop(runtime_pr->worker);
+		if(runtime_pr->worker_late){
+			printk(KERN_DEBUG "fchip: filter thread: %lu frames were played before being filtered\n", 
+				runtime_pr->worker_late);
+		}
+	}
+
+	mutex_lock(&fchip_live_streams_lock);
+	list_del(&runtime_pr->live_node);
+	mutex_unlock(&fchip_live_streams_lock);
+
+	if(runtime_pr->filter_section_samples){
+		printk(KERN_DEBUG "fchip: filter cost: %llu ps per section per sample (%d sections, %llu section-samples)\n",
+			div64_u64(runtime_pr->filter_ns * 1000, runtime_pr->filter_section_samples),
+			runtime_pr->filter_bank.filters[0].active_sections, runtime_pr->filter_section_samples);
+	}
+
+	fchip_filter_bank_free(&runtime_pr->filter_bank);
+	kfree(runtime_pr->copy_buf);
+	vfree(runtime_pr->shadow);
+	kfree(runtime_pr);
+}
+
 int fchip_pcm_open(struct snd_pcm_substream *substream)
 {
 	struct azx_pcm *apcm = snd_pcm_substream_chip(substream);
@@ -244,8 +1105,11 @@ int fchip_pcm_open(struct snd_pcm_substream *substream)
 		err = -EBUSY;
 		goto unlock;
 	}
+	// the readings of the previous stream on this device are not ours;
+	// the drift control reads it under pcm->open_mutex, as held here
+	memset(&azx_dev->drift, 0, sizeof(azx_dev->drift));
 
-	runtime_pr = fchip_runtime_private_init(azx_dev, channel_count = hinfo->channels_max);
+	runtime_pr = fchip_runtime_private_init(substream, azx_dev, channel_count = hinfo->channels_max);
 	if(!runtime_pr){
 		err = -ENOMEM;
 		goto unlock;
@@ -256,10 +1120,18 @@ int fchip_pcm_open(struct snd_pcm_substream *substream)
 	if (fchip_azx->gts_present){
 		runtime->hw.info |= SNDRV_PCM_INFO_HAS_LINK_SYNCHRONIZED_ATIME;
     }
+	// capture doesn't need the appl_ptr; keep the control page mmappable
+	if (substream->stream == SNDRV_PCM_STREAM_CAPTURE){
+		runtime->hw.info &= ~SNDRV_PCM_INFO_SYNC_APPLPTR;
+	}
 
 	runtime->hw.channels_min = hinfo->channels_min;
 	runtime->hw.channels_max = hinfo->channels_max;
 	runtime->hw.formats = hinfo->formats;
+	// the filters work on 32-bit containers, see fchip_filter_prepare
+	if(hinfo->formats & SNDRV_PCM_FMTBIT_S32_LE){
+		runtime->hw.formats = SNDRV_PCM_FMTBIT_S32_LE;
+	}
 	runtime->hw.rates = hinfo->rates;
 	snd_pcm_limit_hw_rates(runtime);
 	snd_pcm_hw_constraint_integer(runtime, SNDRV_PCM_HW_PARAM_PERIODS);
@@ -321,12 +1193,19 @@ int fchip_pcm_open(struct snd_pcm_substream *substream)
 		runtime->hw.info &= ~SNDRV_PCM_INFO_HAS_LINK_ATIME;
 	}
 
+	if(filter_worker){
+		fchip_filter_worker_start(substream);
+	}
+
 	snd_pcm_set_sync(substream);
 	mutex_unlock(&fchip_azx->open_mutex);
 	return 0;
 
  powerdown:
 	snd_hda_power_down(apcm->codec);
+	// off fchip_live_streams again, before any ctl write can reach it
+	fchip_runtime_private_free(runtime_pr);
+	runtime->private_data = NULL;
  unlock:
 	mutex_unlock(&fchip_azx->open_mutex);
 	snd_hda_codec_pcm_put(apcm->info);
@@ -334,11 +1213,6 @@ int fchip_pcm_open(struct snd_pcm_substream *substream)
 }
 
 
-static void fchip_runtime_private_free(struct fchip_runtime_pr *runtime_pr){
-	kfree(runtime_pr->filters);
-	kfree(runtime_pr);
-}
-
 int fchip_pcm_close(struct snd_pcm_substream *substream)
 {
 	struct azx_pcm *apcm = snd_pcm_substream_chip(substream);
@@ -364,12 +1238,82 @@ int fchip_pcm_close(struct snd_pcm_substream *substream)
 }
 
 
+// without snooping the DMA area is uncached or write-combined, and 
+// filtering it in place reads it back at a crawl. playback then gets
+// a cached shadow of the buffer: the application mmaps it (see 
+// fchip_pcm_mmap), the filter works on it and fchip_filter_ring 
+// writes the result out
+static void fchip_pcm_shadow_free(struct fchip_runtime_pr *runtime_pr){
+	vfree(runtime_pr->shadow);
+	runtime_pr->shadow = NULL;
+}
+
+static void fchip_pcm_shadow_alloc(struct snd_pcm_substream *substream, size_t bytes){
+	struct azx_pcm *apcm = snd_pcm_substream_chip(substream);
+	struct fchip_azx *chip = apcm->chip;
+	struct fchip_runtime_pr *runtime_pr = substream->runtime->private_data;
+
+	fchip_pcm_shadow_free(runtime_pr);
+	if(substream->stream != SNDRV_PCM_STREAM_PLAYBACK || (chip->snoop && !chip->uc_buffer)){
+		return;
+	}
+	// not fatal: the filter then works on the DMA area, only slower
+	runtime_pr->shadow = vmalloc_user(PAGE_ALIGN(bytes));
+	if(!runtime_pr->shadow){
+		printk(KERN_WARNING "fchip: no shadow buffer, filtering the uncached DMA area\n");
+	}
+}
+
+int fchip_pcm_mmap(struct snd_pcm_substream *substream, struct vm_area_struct *area)
+{
+	struct fchip_runtime_pr *runtime_pr = substream->runtime->private_data;
+	unsigned long size = area->vm_end - area->vm_start;
+	size_t bytes = PAGE_ALIGN(substream->runtime->dma_bytes);
+
+	if(runtime_pr->shadow){
+		// the shadow is as big as the buffer. the core checks the range
+		// as well, but a user offset isn't handed on unchecked
+		if(size > bytes || area->vm_pgoff > (bytes - size) >> PAGE_SHIFT){
+			return -EINVAL;
+		}
+		return remap_vmalloc_range(area, runtime_pr->shadow, area->vm_pgoff);
+	}
+	return snd_pcm_lib_default_mmap(substream, area);
+}
+
+// lays out the BDL with the stream's own (tuned) adjustment. the core 
+// reads bus->bdl_pos_adj while it builds a BDL, so the field is only 
+// swapped under bdl_pos_adj_lock, and every BDL of the driver is built 
+// here. with a format_val the BDL is always rebuilt, so that a value 
+// tuned while the stream ran applies from the next prepare on
+static int fchip_pcm_setup_bdl(struct fchip_azx *fchip_azx, struct azx_dev *azx_dev, unsigned int format_val)
+{
+	struct hdac_stream *hdas = azx_dev_to_hdac_stream(azx_dev);
+	struct hdac_bus *bus = azx_to_hda_bus(fchip_azx);
+	int err;
+
+	mutex_lock(&fchip_azx->bdl_pos_adj_lock);
+	bus->bdl_pos_adj = fchip_stream_bdl_pos_adj(fchip_azx, azx_dev);
+	if (format_val) {
+		// snd_hdac_stream_set_params skips an unchanged layout
+		hdas->format_val = 0;
+		err = snd_hdac_stream_set_params(hdas, format_val);
+	}
+	else {
+		err = snd_hdac_stream_setup_periods(hdas);
+	}
+	bus->bdl_pos_adj = fchip_azx->bdl_pos_adj;
+	mutex_unlock(&fchip_azx->bdl_pos_adj_lock);
+	return err;
+}
+
 int fchip_pcm_hw_params(struct snd_pcm_substream *substream, struct snd_pcm_hw_params *hw_params)
 {
 	struct azx_pcm *apcm = snd_pcm_substream_chip(substream);
 	struct fchip_azx *fchip_azx = apcm->chip;
 	struct azx_dev *azx_dev = fchip_get_azx_dev(substream);
 	struct hdac_stream *hdas = azx_dev_to_hdac_stream(azx_dev);
+	struct fchip_runtime_pr *runtime_pr = substream->runtime->private_data;
 	int ret = 0;
 
 	dsp_lock(azx_dev);
@@ -385,9 +1329,15 @@ int fchip_pcm_hw_params(struct snd_pcm_substream *substream, struct snd_pcm_hw_p
 	hdas->no_period_wakeup =
 		(hw_params->info & SNDRV_PCM_INFO_NO_PERIOD_WAKEUP) &&
 		(hw_params->flags & SNDRV_PCM_HW_PARAMS_NO_PERIOD_WAKEUP);
-	if (snd_hdac_stream_setup_periods(hdas) < 0){
+	ret = fchip_pcm_setup_bdl(fchip_azx, azx_dev, 0);
+	if (ret < 0){
 		ret = -ENOMEM;
 	}
+	else {
+		mutex_lock(&runtime_pr->worker_lock);
+		fchip_pcm_shadow_alloc(substream, hdas->bufsize);
+		mutex_unlock(&runtime_pr->worker_lock);
+	}
 
 unlock:
 	dsp_unlock(azx_dev);
@@ -400,6 +1350,7 @@ int fchip_pcm_hw_free(struct snd_pcm_substream *substream)
 	struct azx_pcm *apcm = snd_pcm_substream_chip(substream);
 	struct azx_dev *azx_dev = fchip_get_azx_dev(substream);
 	struct hda_pcm_stream *hinfo = to_hda_pcm_stream(substream);
+	struct fchip_runtime_pr *runtime_pr = substream->runtime->private_data;
 
 	// reset BDL address
 	dsp_lock(azx_dev);
@@ -410,19 +1361,43 @@ int fchip_pcm_hw_free(struct snd_pcm_substream *substream)
 
 	azx_dev_to_hdac_stream(azx_dev)->prepared = 0;
 	dsp_unlock(azx_dev);
+	mutex_lock(&runtime_pr->worker_lock);
+	fchip_pcm_shadow_free(runtime_pr);
+	mutex_unlock(&runtime_pr->worker_lock);
 	return 0;
 }
 
-static void fchip_filter_prepare(struct fchip_runtime_pr *runtime_pr, int bits, int channels, int sample_rate){
+static int fchip_filter_prepare(struct snd_pcm_substream *substream, struct fchip_runtime_pr *runtime_pr, 
+	int bits, int channels, int sample_rate){
+	snd_pcm_uframes_t margin;
+
 	runtime_pr->bit_depth = bits;
-	runtime_pr->bytes_per_sample = 4; // weak one
-	runtime_pr->bit_shift = runtime_pr->bytes_per_sample<<3 - runtime_pr->bit_depth;
-	// signed only; hda spec does not say anything about unsigned -> bit_depth-1
-	runtime_pr->sample_max_value = (runtime_pr->bit_depth-1)<<3; 
+	runtime_pr->bytes_per_sample = snd_pcm_format_physical_width(substream->runtime->format) / 8;
+	runtime_pr->bit_shift = (runtime_pr->bytes_per_sample<<3) - runtime_pr->bit_depth;
 	runtime_pr->filter_channels = channels;
-	for(int i=0; i<runtime_pr->filter_channels; i++){
-		fchip_filter_change_params(&runtime_pr->filters[i], FCHIP_FPARAM_FILTERTYPE_NOCHANGE, sample_rate, FCHIP_FPARAM_CUTOFF_NOCHANGE);
+	// the filters take 32-bit containers; fchip_pcm_open only offers 
+	// something else when the codec has no 32-bit format at all
+	if(runtime_pr->bytes_per_sample != sizeof(int32_t)){
+		printk(KERN_WARNING "fchip: %d-bit samples are passed through unfiltered\n", 
+			runtime_pr->bytes_per_sample << 3);
+		runtime_pr->filter_channels = 0;
+	}
+	// prepare restarts the DMA at the start of the buffer, and the 
+	// core resets hw_ptr and appl_ptr to 0 once .prepare returned 
+	// (the old values are still there now); see struct 
+	// fchip_runtime_pr for the units
+	runtime_pr->filter_ptr = 0;
+	// at least two periods: the period interrupt is what kicks the thread
+	margin = div_u64((u64)filter_worker_margin_us * sample_rate, USEC_PER_SEC);
+	if(runtime_pr->worker && margin < 2 * substream->runtime->period_size){
+		printk(KERN_WARNING "fchip: filter_worker_margin_us is shorter than two periods, "
+			"using %lu frames instead of %lu\n", 2 * substream->runtime->period_size, margin);
+		margin = 2 * substream->runtime->period_size;
 	}
+	runtime_pr->worker_margin = min_t(snd_pcm_uframes_t, substream->runtime->buffer_size, margin);
+	// the coefficients come from the cache, see fchip_filter_change_params
+	return fchip_filter_bank_change_params(&runtime_pr->filter_bank, FCHIP_FPARAM_FILTERTYPE_NOCHANGE, sample_rate, 
+		FCHIP_FPARAM_CUTOFF_NOCHANGE, FCHIP_FPARAM_SECTIONS_NOCHANGE, FCHIP_FPARAM_Q_NOCHANGE);
 }
 
 int fchip_pcm_prepare(struct snd_pcm_substream *substream)
@@ -455,10 +1430,14 @@ int fchip_pcm_prepare(struct snd_pcm_substream *substream)
 		goto unlock;
 	}
 
-	fchip_filter_prepare(runtime_pr, bits, runtime->channels, runtime->rate);
+	mutex_lock(&runtime_pr->worker_lock);
+	err = fchip_filter_prepare(substream, runtime_pr, bits, runtime->channels, runtime->rate);
+	mutex_unlock(&runtime_pr->worker_lock);
+	if (err < 0)
+		goto unlock;
 	printk(KERN_DEBUG "fchip: bits:%d channels:%d rate:%d fmt_val:%d\n", bits, runtime->channels, runtime->rate, format_val);
 
-	err = snd_hdac_stream_set_params(azx_dev_to_hdac_stream(azx_dev), format_val);
+	err = fchip_pcm_setup_bdl(fchip_azx, azx_dev, format_val);
 	if (err < 0)
 		goto unlock;
 
@@ -705,6 +1684,72 @@ static int fchip_get_crosststamp(struct snd_pcm_substream *substream,
 					substream, NULL, xtstamp);
 }
 
+// the hardware crosstimestamp polls GTSCC and reads six registers, with
+// retries near a frame rollover. with tstamp_cache_ms, one is taken per
+// interval and the link time in between follows CLOCK_MONOTONIC_RAW at
+// the rate measured between the last two. every hardware read checks 
+// the interpolation against it: the error goes into the accuracy of the
+// interpolated ones, and over tstamp_cache_max_err_ns the next request reads the hardware too.
+// a new stream start (start_wallclk) restarts the link counter
+static int fchip_get_crosststamp_cached(struct snd_pcm_substream *substream,
+			      struct system_device_crosststamp *xtstamp, u32 *accuracy)
+{
+	struct fchip_runtime_pr *pr = substream->runtime->private_data;
+	struct fchip_tstamp_cache *cache = &pr->tstamp;
+	struct azx_dev *azx_dev = pr->dev;
+	unsigned int interval_ms = READ_ONCE(tstamp_cache_ms);
+	struct system_time_snapshot snap;
+	s64 dt, predicted, err, dev_dt;
+	int ret;
+
+	*accuracy = 42; // 24 MHz WallClock == 42ns resolution
+	if (cache->valid && cache->start_wallclk != azx_dev->core.start_wallclk){
+		cache->valid = false;
+		cache->have_rate = false;
+	}
+
+	ktime_get_snapshot(&snap);
+	dt = ktime_to_ns(ktime_sub(snap.raw, cache->sys_monoraw));
+	if (interval_ms && cache->valid && cache->have_rate &&
+	    cache->err_ns <= READ_ONCE(tstamp_cache_max_err_ns) &&
+	    dt >= 0 && dt < (s64)interval_ms * NSEC_PER_MSEC)
+	{
+		xtstamp->device = ktime_add_ns(cache->device, dt + div_s64(dt * cache->ppb, NSEC_PER_SEC));
+		xtstamp->sys_monoraw = snap.raw;
+		xtstamp->sys_realtime = snap.real;
+		*accuracy += cache->err_ns;
+		return 0;
+	}
+
+	ret = fchip_get_crosststamp(substream, xtstamp);
+	if (ret){
+		cache->valid = false;
+		return ret;
+	}
+
+	dt = ktime_to_ns(ktime_sub(xtstamp->sys_monoraw, cache->sys_monoraw));
+	if (cache->valid && dt > 0 && dt < 60 * NSEC_PER_SEC) {
+		dev_dt = ktime_to_ns(ktime_sub(xtstamp->device, cache->device));
+		if (cache->have_rate) {
+			predicted = dt + div_s64(dt * cache->ppb, NSEC_PER_SEC);
+			err = abs(dev_dt - predicted);
+			cache->err_ns = min_t(s64, err, U32_MAX);
+		}
+		// more than 1000 ppm apart is not a clock rate: a stall or a jump
+		cache->have_rate = abs(dev_dt - dt) <= div_s64(dt, 1000);
+		if (cache->have_rate){
+			cache->ppb = div64_s64((dev_dt - dt) * NSEC_PER_SEC, dt);
+		}
+	} else {
+		cache->have_rate = false;
+	}
+	cache->device = xtstamp->device;
+	cache->sys_monoraw = xtstamp->sys_monoraw;
+	cache->start_wallclk = azx_dev->core.start_wallclk;
+	cache->valid = true;
+	return 0;
+}
+
 static inline bool is_link_time_supported(struct snd_pcm_runtime *runtime,
 				struct snd_pcm_audio_tstamp_config *ts)
 {
@@ -723,6 +1768,7 @@ int fchip_pcm_get_time_info(struct snd_pcm_substream *substream,
 	struct azx_dev *azx_dev = fchip_get_azx_dev(substream);
 	struct snd_pcm_runtime *runtime = substream->runtime;
 	struct system_device_crosststamp xtstamp;
+	u32 accuracy;
 	int ret;
 	u64 nsec;
 
@@ -743,7 +1789,7 @@ int fchip_pcm_get_time_info(struct snd_pcm_substream *substream,
 
 	} else if (is_link_time_supported(runtime, audio_tstamp_config)) {
 
-		ret = fchip_get_crosststamp(substream, &xtstamp);
+		ret = fchip_get_crosststamp_cached(substream, &xtstamp, &accuracy);
 		if (ret)
 			return ret;
 
@@ -766,8 +1812,7 @@ int fchip_pcm_get_time_info(struct snd_pcm_substream *substream,
 		audio_tstamp_report->actual_type =
 			SNDRV_PCM_AUDIO_TSTAMP_TYPE_LINK_SYNCHRONIZED;
 		audio_tstamp_report->accuracy_report = 1;
-		// 24 MHz WallClock == 42ns resolution
-		audio_tstamp_report->accuracy = 42;
+		audio_tstamp_report->accuracy = accuracy;
 
 	} else {
 		audio_tstamp_report->actual_type = SNDRV_PCM_AUDIO_TSTAMP_TYPE_DEFAULT;
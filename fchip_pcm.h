@@ -18,14 +18,72 @@ struct azx_pcm {
 	struct list_head list;
 };
 
+// the filter settings a mixer control set edits, see fchip_filter_param_vars
+enum fchip_filter_setting
+{
+	FCHIP_FILTER_SETTING_TYPE,
+	FCHIP_FILTER_SETTING_CUTOFF,
+	FCHIP_FILTER_SETTING_Q,
+	FCHIP_FILTER_SETTING_SECTIONS,
+	FCHIP_FILTER_SETTING_COUNT
+};
+
+// filter settings of one PCM device and direction, exposed as mixer
+// controls. the streams opened on it start with (and follow) these
+struct fchip_filter_ctl
+{
+	struct list_head list;
+	struct snd_pcm *pcm;
+	int stream;
+	int values[FCHIP_FILTER_SETTING_COUNT];
+	struct snd_kcontrol *kctls[FCHIP_FILTER_SETTING_COUNT];
+};
+
+// size of the bounce buffer of fchip_pcm_copy, in frames
+#define FCHIP_COPY_FRAMES 256
+
+// LINK_SYNCHRONIZED timestamps between hardware crosstimestamps: the 
+// link time is interpolated from the last one along CLOCK_MONOTONIC_RAW,
+// see fchip_get_crosststamp_cached
+struct fchip_tstamp_cache
+{
+	ktime_t device;			// the last hardware crosstimestamp
+	ktime_t sys_monoraw;
+	s64 ppb;			// link time rate against CLOCK_MONOTONIC_RAW - 1
+	u32 err_ns;			// the model was off by this much at the last read
+	u32 start_wallclk;		// the stream start the cache belongs to
+	bool valid;
+	bool have_rate;			// ppb is from two reads of the same run
+};
+
 struct fchip_runtime_pr
 {
     struct azx_dev *dev;
 	
+    // first frame not filtered yet: an appl_ptr for playback,
+    // an offset in the buffer for capture
     snd_pcm_uframes_t filter_ptr;
-    struct fchip_channel_filter *filters; 
+	atomic_t filter_busy;		// .copy against .ack, see fchip_filter_claim
+    struct fchip_filter_bank filter_bank;
     int filter_channels;    // amount of actually present filters
-	int filter_count;       // max filters available
+	s32 *copy_buf;			// playback only, FCHIP_COPY_FRAMES frames
+	void *shadow;			// cached copy of the DMA buffer, see fchip_pcm_mmap
+
+	// filter thread (filter_worker=1), NULL: the callbacks filter
+	struct task_struct *worker;
+	wait_queue_head_t worker_wait;
+	atomic_t worker_kick;
+	struct mutex worker_lock;	// the thread against prepare and hw_params
+	snd_pcm_uframes_t worker_margin;	// playback: frames filtered ahead of the DMA
+	unsigned long worker_late;	// playback frames the DMA got to first
+	struct list_head live_node;	// fchip_live_streams, see fchip_pcm.c
+	struct fchip_filter_ctl *filter_ctl;	// NULL: follows the module params
+
+	struct fchip_tstamp_cache tstamp;
+
+	// filter cost accounting, reported when the stream is closed
+	u64 filter_ns;
+	u64 filter_section_samples;
 
 	int bytes_per_sample;
 	int bit_depth;
@@ -33,16 +91,23 @@ struct fchip_runtime_pr
 	// bit shift describes the amount of excessive bits 
 	// that do not possess any value (must be zero, or 
 	// sign-extended in the conversion process) 
-	int bit_shift; 			// aggregating field; equal to bytes_for<<3-bit_depth
-	int sample_max_value; 	// aggregating field; equal to (bit_depth-1)<<3;
+	int bit_shift; 			// aggregating field; equal to (bytes_per_sample<<3)-bit_depth
 };
 
 
 void fchip_pcm_validate_filter_params(void);
+int fchip_pcm_add_filter_controls(struct snd_pcm *pcm, int stream);
+int fchip_pcm_add_drift_control(struct snd_pcm *pcm, int stream);
 
 int fchip_pcm_open(struct snd_pcm_substream *substream);
 int fchip_pcm_close(struct snd_pcm_substream *substream);
 snd_pcm_uframes_t fchip_pcm_pointer(struct snd_pcm_substream *substream);
+int fchip_pcm_ack(struct snd_pcm_substream *substream);
+int fchip_pcm_mmap(struct snd_pcm_substream *substream, struct vm_area_struct *area);
+int fchip_pcm_copy(struct snd_pcm_substream *substream, int channel, unsigned long pos, 
+	struct iov_iter *iter, unsigned long bytes);
+// what the period interrupt calls instead of snd_pcm_period_elapsed
+void fchip_pcm_period_elapsed(struct snd_pcm_substream *substream);
 
 
 int fchip_pcm_hw_params(struct snd_pcm_substream *substream, struct snd_pcm_hw_params *hw_params);
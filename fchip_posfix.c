@@ -157,7 +157,7 @@ static int fchip_get_delay_from_lpib(struct fchip_azx *chip, struct azx_dev *azx
 			 delay, azx_dev->core.period_bytes);
 		delay = 0;
 		chip->driver_caps &= ~AZX_DCAPS_COUNT_LPIB_DELAY;
-		chip->get_delay[stream] = NULL;
+		WRITE_ONCE(chip->delay_method[stream], FCHIP_DELAY_NONE);
 	}
 
 	return bytes_to_frames(substream->runtime, delay);
@@ -165,30 +165,60 @@ static int fchip_get_delay_from_lpib(struct fchip_azx *chip, struct azx_dev *azx
 
 void assign_position_fix(struct fchip_azx *chip, int fix)
 {
-    static const azx_get_pos_callback_t callbacks[] = {
-		[POS_FIX_AUTO] = NULL,
-		[POS_FIX_LPIB] = fchip_get_pos_lpib,
-		[POS_FIX_POSBUF] = fchip_get_pos_posbuf,
-		[POS_FIX_VIACOMBO] = fchip_via_get_position,
-		[POS_FIX_COMBO] = fchip_get_pos_lpib,
-		[POS_FIX_SKL] = fchip_get_pos_posbuf,
-		[POS_FIX_FIFO] = fchip_get_pos_fifo,
+	static const u8 methods[] = {
+		[POS_FIX_AUTO] = FCHIP_POS_DEFAULT,
+		[POS_FIX_LPIB] = FCHIP_POS_LPIB,
+		[POS_FIX_POSBUF] = FCHIP_POS_POSBUF,
+		[POS_FIX_VIACOMBO] = FCHIP_POS_VIA,
+		[POS_FIX_COMBO] = FCHIP_POS_LPIB,
+		[POS_FIX_SKL] = FCHIP_POS_POSBUF,
+		[POS_FIX_FIFO] = FCHIP_POS_FIFO,
 	};
 
-	chip->get_position[0] = chip->get_position[1] = callbacks[fix];
+	chip->pos_method[0] = chip->pos_method[1] = methods[fix];
+	chip->delay_method[0] = chip->delay_method[1] = FCHIP_DELAY_NONE;
 
 	// combo mode uses LPIB only for playback
 	if (fix == POS_FIX_COMBO){
-		chip->get_position[1] = NULL;
+		chip->pos_method[1] = FCHIP_POS_DEFAULT;
     }
 
 	if ((fix == POS_FIX_POSBUF || fix == POS_FIX_SKL) &&
 	    (chip->driver_caps & AZX_DCAPS_COUNT_LPIB_DELAY)) {
-		chip->get_delay[0] = chip->get_delay[1] = fchip_get_delay_from_lpib;
+		chip->delay_method[0] = chip->delay_method[1] = FCHIP_DELAY_LPIB;
 	}
 
 	if (fix == POS_FIX_FIFO)
-		chip->get_delay[0] = chip->get_delay[1] = fchip_get_delay_from_fifo;
+		chip->delay_method[0] = chip->delay_method[1] = FCHIP_DELAY_FIFO;
+}
+
+// the position and delay reads of the pointer callback and the period
+// interrupts. a switch of direct calls: the kernel is built without 
+// jump tables, so this is a couple of compares and no indirect branch
+unsigned int fchip_get_position(struct fchip_azx *chip, struct azx_dev *azx_dev, int stream)
+{
+	switch (READ_ONCE(chip->pos_method[stream])) {
+	case FCHIP_POS_LPIB:
+		return fchip_get_pos_lpib(chip, azx_dev);
+	case FCHIP_POS_VIA:
+		return fchip_via_get_position(chip, azx_dev);
+	case FCHIP_POS_FIFO:
+		return fchip_get_pos_fifo(chip, azx_dev);
+	default:
+		return fchip_get_pos_posbuf(chip, azx_dev);
+	}
+}
+
+int fchip_get_delay(struct fchip_azx *chip, struct azx_dev *azx_dev, int stream, unsigned int pos)
+{
+	switch (READ_ONCE(chip->delay_method[stream])) {
+	case FCHIP_DELAY_LPIB:
+		return fchip_get_delay_from_lpib(chip, azx_dev, pos);
+	case FCHIP_DELAY_FIFO:
+		return fchip_get_delay_from_fifo(chip, azx_dev, pos);
+	default:
+		return 0;
+	}
 }
 
 
@@ -236,6 +266,113 @@ int check_position_fix(struct fchip_azx *chip, int fix)
 	return POS_FIX_AUTO;
 }
 
+// bdl_pos_adj tuning. the BDL delays the period interrupts by 
+// bdl_pos_adj frames, so that the position has crossed the boundary 
+// when they come; an interrupt that is still early is deferred to a 
+// timer (fchip_irq_pending_arm). every window of interrupts with too 
+// many deferrals, the stream's adjustment grows to cover the largest 
+// shortfall seen; it takes effect with the next hw_params
+#define FCHIP_BDL_TUNE_WINDOW 256
+#define FCHIP_BDL_TUNE_MAX_DEFERRED 4	// per window
+#define FCHIP_BDL_POS_ADJ_MAX 512
+
+static void fchip_bdl_pos_adj_tune(struct fchip_azx *chip, struct azx_dev *azx_dev)
+{
+	struct fchip_irq_timing *timing = &azx_dev->timing;
+	int adj = timing->bdl_pos_adj < 0 ? chip->bdl_pos_adj : timing->bdl_pos_adj;
+	int tuned;
+
+	if (timing->window_deferred > FCHIP_BDL_TUNE_MAX_DEFERRED && adj < FCHIP_BDL_POS_ADJ_MAX) {
+		tuned = min_t(int, roundup_pow_of_two(adj + timing->window_short), FCHIP_BDL_POS_ADJ_MAX);
+		printk(KERN_INFO "fchip: stream %d: %u of %u interrupts early, bdl_pos_adj %d -> %d\n",
+			azx_dev->core.index, timing->window_deferred, timing->window_irqs, adj, tuned);
+		timing->bdl_pos_adj = tuned;
+	}
+
+	timing->window_irqs = 0;
+	timing->window_deferred = 0;
+	timing->window_short = 0;
+}
+
+// once per interrupt, not for the rechecks of a deferred one
+static void fchip_irq_timing_record(struct fchip_azx *chip, struct azx_dev *azx_dev, u32 wallclk, unsigned int pos)
+{
+	struct fchip_irq_timing *timing = &azx_dev->timing;
+	unsigned int bin;
+
+	if (azx_dev->irq_pending){
+		return;
+	}
+
+	bin = div_u64((u64)wallclk * 8, azx_dev->core.period_wallclk ?: 1);
+	timing->wallclk_hist[min_t(unsigned int, bin, FCHIP_IRQ_HIST_BINS - 1)]++;
+	bin = (pos % azx_dev->core.period_bytes) * FCHIP_IRQ_HIST_BINS / azx_dev->core.period_bytes;
+	timing->pos_hist[min_t(unsigned int, bin, FCHIP_IRQ_HIST_BINS - 1)]++;
+	timing->irqs++;
+	timing->window_irqs++;
+}
+
+static void fchip_irq_timing_short(struct fchip_azx *chip, struct azx_dev *azx_dev, snd_pcm_uframes_t frames)
+{
+	struct fchip_irq_timing *timing = &azx_dev->timing;
+
+	if (azx_dev->irq_pending){
+		return;
+	}
+	timing->deferred++;
+	timing->window_deferred++;
+	timing->window_short = max_t(u32, timing->window_short, frames);
+}
+
+static void fchip_irq_timing_done(struct fchip_azx *chip, struct azx_dev *azx_dev)
+{
+	if (chip->bdl_pos_adj_auto && azx_dev->timing.window_irqs >= FCHIP_BDL_TUNE_WINDOW){
+		fchip_bdl_pos_adj_tune(chip, azx_dev);
+	}
+}
+
+// what the next BDL of the stream is laid out with
+int fchip_stream_bdl_pos_adj(struct fchip_azx *chip, struct azx_dev *azx_dev)
+{
+	if (!chip->bdl_pos_adj_auto || azx_dev->timing.bdl_pos_adj < 0){
+		return chip->bdl_pos_adj;
+	}
+	return azx_dev->timing.bdl_pos_adj;
+}
+
+// drift windows: at least a second, and WALLCLK wraps after 178 s
+#define FCHIP_DRIFT_WINDOW_NS	NSEC_PER_SEC
+#define FCHIP_DRIFT_MAX_NS	(100 * NSEC_PER_SEC)
+// the low-pass: a plain average of the first windows, then 1/8 per window
+#define FCHIP_DRIFT_GAIN	8
+
+// a window ends at the first period interrupt a second after it began;
+// the WALLCLK ticks in it against CLOCK_MONOTONIC_RAW give one drift
+// reading. more than 1000 ppm off is a stall (suspend, a stopped 
+// stream), not a clock: the window starts over
+static void fchip_drift_record(struct azx_dev *azx_dev, u32 wallclk, u64 now)
+{
+	struct fchip_drift *drift = &azx_dev->drift;
+	u64 elapsed = now - drift->anchor_ns;
+	s64 diff, ppb, gain;
+
+	if (drift->anchor_ns && elapsed < FCHIP_DRIFT_WINDOW_NS){
+		return;
+	}
+	if (drift->anchor_ns && elapsed < FCHIP_DRIFT_MAX_NS) {
+		diff = (s64)FCHIP_WALLCLK_TO_NS(wallclk - drift->anchor_wallclk) - (s64)elapsed;
+		if (abs(diff) <= div_u64(elapsed, 1000)) {
+			ppb = div64_s64(diff * NSEC_PER_SEC, elapsed);
+			gain = min_t(u64, drift->windows + 1, FCHIP_DRIFT_GAIN);
+			drift->ppb += div_s64(ppb - drift->ppb, gain);
+			drift->dev_ppb += div_s64(abs(ppb - drift->ppb) - drift->dev_ppb, gain);
+			drift->windows++;
+		}
+	}
+	drift->anchor_ns = now;
+	drift->anchor_wallclk = wallclk;
+}
+
 /*
  * Check whether the current DMA position is acceptable for updating
  * periods.  Returns non-zero if it's OK.
@@ -258,37 +395,39 @@ int fchip_position_ok(struct fchip_azx* fchip_azx, struct azx_dev* azx_dev)
 
 	// The value of the WALLCLK register is always 0
 	// on the Loongson controller, so we return directly. 
-	if (fchip_azx->driver_type == AZX_DRIVER_LOONGSON){
+	if (fchip_quirk_loongson(fchip_azx)){
 		return 1;
 	}
 
-	wallclk = fchip_readreg_l(fchip_azx, WALLCLK) - azx_dev->core.start_wallclk;
+	wallclk = fchip_readreg_l(fchip_azx, WALLCLK);
+	fchip_drift_record(azx_dev, wallclk, ktime_get_raw_ns());
+	wallclk -= azx_dev->core.start_wallclk;
 	if (wallclk < (azx_dev->core.period_wallclk * 2) / 3){
 		return -1;	// bogus (too early) interrupt
 	}
 
-	if (fchip_azx->get_position[stream]){
-		pos = fchip_azx->get_position[stream](fchip_azx, azx_dev);
+	if (fchip_azx->pos_method[stream] != FCHIP_POS_DEFAULT){
+		pos = fchip_get_position(fchip_azx, azx_dev, stream);
 	}
 	else { // use the position buffer as default
 		pos = fchip_get_pos_posbuf(fchip_azx, azx_dev);
 		if (!pos || pos == (u32)-1) {
 			printk(KERN_INFO "fchip: Invalid position buffer, using LPIB read method instead.\n");
-			fchip_azx->get_position[stream] = fchip_get_pos_lpib;
-			if (fchip_azx->get_position[0] == fchip_get_pos_lpib &&
-			    fchip_azx->get_position[1] == fchip_get_pos_lpib)
+			WRITE_ONCE(fchip_azx->pos_method[stream], FCHIP_POS_LPIB);
+			if (fchip_azx->pos_method[0] == FCHIP_POS_LPIB &&
+			    fchip_azx->pos_method[1] == FCHIP_POS_LPIB)
 			{
 				azx_to_hda_bus(fchip_azx)->use_posbuf = false;
 			}
 
 			pos = fchip_get_pos_lpib(fchip_azx, azx_dev);
-			fchip_azx->get_delay[stream] = NULL;
+			WRITE_ONCE(fchip_azx->delay_method[stream], FCHIP_DELAY_NONE);
 		} 
 		else {
-			fchip_azx->get_position[stream] = fchip_get_pos_posbuf;
+			WRITE_ONCE(fchip_azx->pos_method[stream], FCHIP_POS_POSBUF);
 			if (fchip_azx->driver_caps & AZX_DCAPS_COUNT_LPIB_DELAY)
 			{
-				fchip_azx->get_delay[stream] = fchip_get_delay_from_lpib;
+				WRITE_ONCE(fchip_azx->delay_method[stream], FCHIP_DELAY_LPIB);
 			}
 		}
 	}
@@ -300,19 +439,25 @@ int fchip_position_ok(struct fchip_azx* fchip_azx, struct azx_dev* azx_dev)
 	if (WARN_ONCE(!azx_dev->core.period_bytes,
 		      "hda-intel: zero azx_dev->period_bytes"))
 		return -1; // this shouldn't happen!
+	fchip_irq_timing_record(fchip_azx, azx_dev, wallclk, pos);
 	if (wallclk < (azx_dev->core.period_wallclk * 5) / 4 &&
 	    pos % azx_dev->core.period_bytes > azx_dev->core.period_bytes / 2)
 	{
 		// NG - it's below the first next period boundary
+		fchip_irq_timing_short(fchip_azx, azx_dev, bytes_to_frames(runtime, 
+			azx_dev->core.period_bytes - pos % azx_dev->core.period_bytes));
+		fchip_irq_timing_done(fchip_azx, azx_dev);
 		return fchip_azx->bdl_pos_adj ? 0 : -1;
 	}
 	azx_dev->core.start_wallclk += wallclk;
 
 	if (azx_dev->core.no_period_wakeup){
+		fchip_irq_timing_done(fchip_azx, azx_dev);
 		return 1; // OK, no need to check period boundary
 	}
 
 	if (runtime->hw_ptr_base != runtime->hw_ptr_interrupt){
+		fchip_irq_timing_done(fchip_azx, azx_dev);
 		return 1; // OK, already in hwptr updating process
 	}
 
@@ -327,8 +472,11 @@ int fchip_position_ok(struct fchip_azx* fchip_azx, struct azx_dev* azx_dev)
 	target = runtime->hw_ptr_interrupt + runtime->period_size;
 	if (hwptr < target) {
 		// too early wakeup, process it later
+		fchip_irq_timing_short(fchip_azx, azx_dev, target - hwptr);
+		fchip_irq_timing_done(fchip_azx, azx_dev);
 		return fchip_azx->bdl_pos_adj ? 0 : -1;
 	}
 
+	fchip_irq_timing_done(fchip_azx, azx_dev);
 	return 1; // OK, it's fine
 }
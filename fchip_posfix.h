@@ -22,4 +22,7 @@ int check_position_fix(struct fchip_azx *chip, int fix);
 
 unsigned int fchip_get_pos_lpib(struct fchip_azx* chip, struct azx_dev* azx_dev);
 unsigned int fchip_get_pos_posbuf(struct fchip_azx *chip, struct azx_dev *azx_dev);
-int fchip_position_ok(struct fchip_azx* fchip_azx, struct azx_dev* azx_dev);
\ No newline at end of file
+unsigned int fchip_get_position(struct fchip_azx *chip, struct azx_dev *azx_dev, int stream);
+int fchip_get_delay(struct fchip_azx *chip, struct azx_dev *azx_dev, int stream, unsigned int pos);
+int fchip_position_ok(struct fchip_azx* fchip_azx, struct azx_dev* azx_dev);
+int fchip_stream_bdl_pos_adj(struct fchip_azx *chip, struct azx_dev *azx_dev);
\ No newline at end of file